@@ -0,0 +1,431 @@
+#include "dmf2esf.h"
+
+#include <atomic>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #include <process.h>
+    #define getpid _getpid
+#else
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+/* Bump this whenever the entry layout changes */
+static const uint32_t sCacheVersion = 4;
+static const char sCacheMagic[4] = { 'D', 'M', 'F', 'C' };
+static const char sSampleMagic[4] = { 'D', 'M', 'F', 'S' };
+
+/** FNV-1a, only used to name cache entries */
+static void HashBytes(uint64_t& hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+}
+
+template <typename T> static void HashValue(uint64_t& hash, const T& value)
+{
+	HashBytes(hash, &value, sizeof(T));
+}
+
+static void PutU32(std::vector<uint8_t>& out, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+		out.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static void PutBytes(std::vector<uint8_t>& out, const uint8_t* data, size_t size)
+{
+	PutU32(out, size);
+	out.insert(out.end(), data, data + size);
+}
+
+/** Bounds checked reader for cache entries, a damaged entry is just a miss */
+class EntryReader
+{
+public:
+	EntryReader(const std::vector<uint8_t>& data) : m_data(data), m_offset(0), m_failed(false) {}
+
+	bool Failed() const { return m_failed; }
+	bool AtEnd() const { return m_offset == m_data.size(); }
+
+	const uint8_t* Read(size_t size)
+	{
+		if(m_failed || size > m_data.size() - m_offset)
+		{
+			m_failed = true;
+			return NULL;
+		}
+
+		const uint8_t* ptr = &m_data[0] + m_offset;
+		m_offset += size;
+		return ptr;
+	}
+
+	uint32_t ReadU32()
+	{
+		const uint8_t* ptr = Read(4);
+		return ptr ? Stream::ReadU32(ptr) : 0;
+	}
+
+	uint8_t ReadU8()
+	{
+		const uint8_t* ptr = Read(1);
+		return ptr ? *ptr : 0;
+	}
+
+	void ReadBytes(std::vector<uint8_t>& out)
+	{
+		uint32_t size = ReadU32();
+		const uint8_t* ptr = Read(size);
+		if(ptr)
+			out.assign(ptr, ptr + size);
+	}
+
+private:
+	const std::vector<uint8_t>& m_data;
+	size_t m_offset;
+	bool m_failed;
+};
+
+static bool ReadWholeFile(const char* Filename, std::vector<uint8_t>& data)
+{
+	FILE* file = fopen(Filename, "rb");
+	if(!file)
+		return 1;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	bool failed = size < 0;
+	if(!failed)
+	{
+		data.resize(size);
+		failed = size > 0 && fread(&data[0], size, 1, file) != 1;
+	}
+
+	fclose(file);
+	return failed;
+}
+
+static bool WriteWholeFile(const char* Filename, const std::vector<uint8_t>& data, bool binary = true)
+{
+	FILE* file = fopen(Filename, binary ? "wb" : "w");
+	if(!file)
+		return 1;
+
+	bool failed = !data.empty() && fwrite(&data[0], data.size(), 1, file) != 1;
+	fclose(file);
+	return failed;
+}
+
+/** @brief Writes an entry under a temporary name first so other jobs never see half of it. The
+    name is unique to this process and write, other processes may share the directory. **/
+static bool WriteEntry(const std::string& path, const std::vector<uint8_t>& entry)
+{
+	static std::atomic<uint32_t> counter(0);
+
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), (unsigned)counter++);
+	std::string tempPath = path + suffix;
+
+	if(WriteWholeFile(tempPath.c_str(), entry))
+	{
+		remove(tempPath.c_str());
+		return 1;
+	}
+
+	//Another job may have stored the same entry in the meantime, either copy will do
+	if(rename(tempPath.c_str(), path.c_str()))
+	{
+		remove(tempPath.c_str());
+	}
+
+	return 0;
+}
+
+ConversionCache::ConversionCache(const std::string& directory)
+{
+	m_directory = directory;
+
+	//Create the directory on first use, an existing one is fine
+#ifdef _WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0777);
+#endif
+}
+
+/** @brief Hashes the compressed module together with everything that changes the output. The
+    converter version is included so entries from a converter that wrote different output are
+    never reused. **/
+uint64_t ConversionCache::GetKey(const uint8_t* dmfData, size_t dmfSize, const ConvertOptions& options) const
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	HashValue(hash, sCacheVersion);
+	HashValue(hash, (uint32_t)CONVERTER_VERSION);
+
+	HashValue(hash, ASMOut);
+	HashValue(hash, ExCommands);
+	HashValue(hash, options.m_loopWholeTrack);
+	HashValue(hash, options.m_lockChannels);
+	HashValue(hash, options.m_PALMode);
+	HashValue(hash, options.m_instrumentOffset);
+	HashValue(hash, options.m_optimize);
+	HashValue(hash, options.m_sampleQuality);
+	HashValue(hash, options.m_costBudget);
+	HashValue(hash, options.m_reportRepeats);
+	HashValue(hash, options.m_useTables);
+	if(options.m_useTables)
+	{
+		HashBytes(hash, options.m_instrumentTable, sizeof(options.m_instrumentTable));
+		HashBytes(hash, options.m_sampleTable, sizeof(options.m_sampleTable));
+	}
+
+	HashValue(hash, (uint64_t)dmfSize);
+	HashBytes(hash, dmfData, dmfSize);
+
+	return hash;
+}
+
+/** @brief Hashes a sample's data and everything its conversion depends on. Pitch and amplitude
+    aren't applied yet, they're in the key so entries stay valid once they are. **/
+uint64_t ConversionCache::GetSampleKey(const DMFFile::Sample& sample, uint8_t quality) const
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	HashValue(hash, sCacheVersion);
+	HashValue(hash, (uint32_t)CONVERTER_VERSION);
+
+	HashValue(hash, quality);
+	HashValue(hash, sample.m_sampleRate);
+	HashValue(hash, sample.m_bitsPerSample);
+	HashValue(hash, sample.m_amplitude);
+	HashValue(hash, sample.m_pitch);
+
+	HashValue(hash, sample.m_sampleSize);
+	HashBytes(hash, sample.m_sampleData, sample.m_sampleSize * sizeof(uint16_t));
+
+	return hash;
+}
+
+std::string ConversionCache::GetEntryPath(uint64_t key, const char* extension) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)key, extension);
+	return m_directory + "/" + name;
+}
+
+/** @brief Reads a stored conversion, returns true on a miss **/
+bool ConversionCache::Load(uint64_t key, ConvertOutput& output) const
+{
+	std::vector<uint8_t> entry;
+	if(ReadWholeFile(GetEntryPath(key, "dmfc").c_str(), entry))
+		return 1;
+
+	EntryReader reader(entry);
+
+	const uint8_t* magic = reader.Read(sizeof(sCacheMagic));
+	if(!magic || memcmp(magic, sCacheMagic, sizeof(sCacheMagic)) || reader.ReadU32() != sCacheVersion)
+		return 1;
+
+	uint32_t keyLo = reader.ReadU32();
+	uint32_t keyHi = reader.ReadU32();
+	if(keyLo != (uint32_t)key || keyHi != (uint32_t)(key >> 32))
+		return 1;
+
+	output.m_numInstruments = reader.ReadU8();
+	output.m_numSamples = reader.ReadU8();
+	output.m_repeatSavings = reader.ReadU32();
+
+	std::vector<uint8_t> costReport;
+	reader.ReadBytes(costReport);
+	output.m_costReport.assign(costReport.begin(), costReport.end());
+
+	uint32_t channelMask = reader.ReadU32();
+	output.m_usedChannels.clear();
+	for(int i = 0; i < 32; i++)
+	{
+		if(channelMask & (1 << i))
+			output.m_usedChannels.insert(i);
+	}
+
+	reader.ReadBytes(output.m_esf);
+
+	uint32_t numFiles = reader.ReadU32();
+	output.m_files.clear();
+	for(uint32_t i = 0; i < numFiles && !reader.Failed(); i++)
+	{
+		output.m_files.push_back(OutputFile());
+
+		std::vector<uint8_t> name;
+		reader.ReadBytes(name);
+		output.m_files.back().m_name.assign(name.begin(), name.end());
+		reader.ReadBytes(output.m_files.back().m_data);
+	}
+
+	return reader.Failed();
+}
+
+/** @brief Stores a conversion. Written under a temporary name first so other jobs never see half an entry **/
+bool ConversionCache::Store(uint64_t key, const ConvertOutput& output) const
+{
+	std::vector<uint8_t> entry;
+
+	entry.insert(entry.end(), sCacheMagic, sCacheMagic + sizeof(sCacheMagic));
+	PutU32(entry, sCacheVersion);
+	PutU32(entry, (uint32_t)key);
+	PutU32(entry, (uint32_t)(key >> 32));
+
+	entry.push_back(output.m_numInstruments);
+	entry.push_back(output.m_numSamples);
+	PutU32(entry, output.m_repeatSavings);
+	PutBytes(entry, (const uint8_t*)output.m_costReport.c_str(), output.m_costReport.size());
+
+	uint32_t channelMask = 0;
+	for(std::set<uint8_t>::const_iterator it = output.m_usedChannels.begin(); it != output.m_usedChannels.end(); ++it)
+		channelMask |= 1 << *it;
+	PutU32(entry, channelMask);
+
+	PutBytes(entry, output.m_esf.empty() ? NULL : &output.m_esf[0], output.m_esf.size());
+
+	PutU32(entry, output.m_files.size());
+	for(size_t i = 0; i < output.m_files.size(); i++)
+	{
+		const OutputFile& file = output.m_files[i];
+		PutBytes(entry, (const uint8_t*)file.m_name.c_str(), file.m_name.size());
+		PutBytes(entry, file.m_data.empty() ? NULL : &file.m_data[0], file.m_data.size());
+	}
+
+	return WriteEntry(GetEntryPath(key, "dmfc"), entry);
+}
+
+/** @brief Checksum of a stored sample, catches entries that were cut short or damaged on disk **/
+static uint32_t GetSampleChecksum(const std::vector<uint8_t>& ewf)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	HashValue(hash, (uint64_t)ewf.size());
+	HashBytes(hash, ewf.empty() ? NULL : &ewf[0], ewf.size());
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/** @brief Reads a converted sample, returns true on a miss **/
+bool ConversionCache::LoadSample(uint64_t key, std::vector<uint8_t>& ewf) const
+{
+	std::vector<uint8_t> entry;
+	if(ReadWholeFile(GetEntryPath(key, "ewfc").c_str(), entry))
+		return 1;
+
+	EntryReader reader(entry);
+
+	const uint8_t* magic = reader.Read(sizeof(sSampleMagic));
+	if(!magic || memcmp(magic, sSampleMagic, sizeof(sSampleMagic)) || reader.ReadU32() != sCacheVersion)
+		return 1;
+
+	uint32_t keyLo = reader.ReadU32();
+	uint32_t keyHi = reader.ReadU32();
+	if(keyLo != (uint32_t)key || keyHi != (uint32_t)(key >> 32))
+		return 1;
+
+	reader.ReadBytes(ewf);
+	uint32_t checksum = reader.ReadU32();
+
+	//Length, checksum and end marker must all still match
+	return reader.Failed() || !reader.AtEnd() || checksum != GetSampleChecksum(ewf) || ewf.empty() || ewf.back() != 0xFF;
+}
+
+/** @brief Stores a converted sample, shared by every module that uses it **/
+bool ConversionCache::StoreSample(uint64_t key, const std::vector<uint8_t>& ewf) const
+{
+	std::vector<uint8_t> entry;
+
+	entry.insert(entry.end(), sSampleMagic, sSampleMagic + sizeof(sSampleMagic));
+	PutU32(entry, sCacheVersion);
+	PutU32(entry, (uint32_t)key);
+	PutU32(entry, (uint32_t)(key >> 32));
+	PutBytes(entry, ewf.empty() ? NULL : &ewf[0], ewf.size());
+	PutU32(entry, GetSampleChecksum(ewf));
+
+	return WriteEntry(GetEntryPath(key, "ewfc"), entry);
+}
+
+/** @brief Writes a finished conversion: the ESF stream to outFilename, instruments and samples to the
+    working directory under their own names. Returns true on failure. **/
+bool WriteConvertOutput(const char* outFilename, const ConvertOutput& output)
+{
+	if(WriteWholeFile(outFilename, output.m_esf, !ASMOut))
+	{
+		fprintf(stderr, "Failed to open output. Aborting...\n");
+		return 1;
+	}
+
+	for(size_t i = 0; i < output.m_files.size(); i++)
+	{
+		if(WriteWholeFile(output.m_files[i].m_name.c_str(), output.m_files[i].m_data))
+		{
+			fprintf(stderr, "Failed to write %s\n", output.m_files[i].m_name.c_str());
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Converts inFilename in memory, reusing a stored conversion when the module and options
+    match. Nothing but cache entries is written. **/
+ConvertResult ConversionCache::GetOutput(const char* inFilename, const ConvertOptions& options, ConvertOutput& output, bool VerboseLog)
+{
+	std::vector<uint8_t> dmfData;
+	if(ReadWholeFile(inFilename, dmfData))
+	{
+		fprintf(stderr, "File not found: %s\n", inFilename);
+		return CONVERT_IO_ERROR;
+	}
+
+	uint64_t key = GetKey(dmfData.empty() ? NULL : &dmfData[0], dmfData.size(), options);
+
+	if(Load(key, output) == 0)
+	{
+		if(VerboseLog)
+		{
+			fprintf(stdout, "Cache hit for %s\n", inFilename);
+		}
+		return CONVERT_OK;
+	}
+
+	//Samples shared with modules converted before are taken from the cache as well
+	ConvertOptions sampleOptions = options;
+	sampleOptions.m_sampleCache = this;
+
+	ConvertResult result = ConvertDMF(dmfData.empty() ? NULL : &dmfData[0], dmfData.size(), sampleOptions, output);
+	if(result != CONVERT_OK)
+		return result;
+
+	if(Store(key, output))
+	{
+		fprintf(stderr, "Failed to write cache entry for %s\n", inFilename);
+	}
+
+	return CONVERT_OK;
+}
+
+/** @brief Converts inFilename to outFilename, reusing a stored conversion when the module and options
+    match. Instruments and samples are written to the working directory as usual. **/
+ConvertResult ConversionCache::Convert(const char* inFilename, const char* outFilename, const ConvertOptions& options, ConvertOutput& output, bool VerboseLog)
+{
+	ConvertResult result = GetOutput(inFilename, options, output, VerboseLog);
+	if(result != CONVERT_OK)
+		return result;
+
+	if(WriteConvertOutput(outFilename, output))
+		return CONVERT_IO_ERROR;
+
+	return CONVERT_OK;
+}
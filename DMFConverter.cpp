@@ -2,6 +2,21 @@
 #include "samplerate.h"
 
 #include <set>
+#include <thread>
+#include <atomic>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
 
 template <typename T> T Clamp(T value, T min, T max)
 {
@@ -17,6 +32,51 @@ template <typename T> T Clamp(T value, T min, T max)
 
 using namespace std;
 
+//YM2612 and SN76489 clocks, the master clock divided by 7 and 15
+constexpr FrequencyTable NTSCFrequencies(53693175.0 / 7, 53693175.0 / 15);
+constexpr FrequencyTable PALFrequencies(53203424.0 / 7, 53203424.0 / 15);
+
+static_assert(NTSCFrequencies.m_fm[0] == 644 && NTSCFrequencies.m_psg[0][0] == 855, "Frequency tables not built at compile time");
+
+//Highest pitch effects can reach, B-7 in 16.16 semitones
+static const int32_t sMaxPitch = (8 * 12 - 1) << 16;
+
+//12 / ln(2) in 16.16, turns a small frequency ratio into semitones
+static const int64_t sSemitonesPerRatio = 1134582;
+
+/** One sine cycle for vibrato and tremolo, in 16.16 */
+struct LFOTable
+{
+	static const int sNumSteps = 64;
+
+	static constexpr double sPi = 3.14159265358979323846;
+
+	constexpr LFOTable() : m_sine()
+	{
+		for(int i = 0; i < sNumSteps; i++)
+		{
+			//Taylor series around 0, sin() isn't constexpr
+			double x = 2 * sPi * i / sNumSteps;
+			if(x > sPi)
+				x -= 2 * sPi;
+
+			double term = x;
+			double sum = x;
+			for(int n = 1; n < 12; n++)
+			{
+				term *= -x * x / ((2 * n) * (2 * n + 1));
+				sum += term;
+			}
+
+			m_sine[i] = (int32_t)(sum * 0x10000 + (sum < 0 ? -0.5 : 0.5));
+		}
+	}
+
+	int32_t m_sine[sNumSteps];
+};
+
+static constexpr LFOTable sLFOTable;
+
 const int DMFFile::sSampleRates[6] =
 {
 	0,		// 0
@@ -31,11 +91,15 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
 {
     esf = *esfout;
 
+    //Zero everything first, so parse states compare byte for byte (see ParseState)
+    memset((void*)Channels, 0, sizeof(Channels));
+
     /* Initialize all the variables */
     SongType = 0;
     TickBase = 0;
     TickTimeEvenRow = 0;
     TickTimeOddRow = 0;
+    Frequencies = &NTSCFrequencies;
     RegionType = 0;
     CurrPattern = 0;
     CurrRow = 0;
@@ -44,14 +108,29 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
     NextRow = 0;
     TotalRowsPerPattern = 0;
     TotalPatterns = 0;
-    PatternList = 0;
+    PatternData = 0;
     ArpTickSpeed = 0;
 
     ChannelCount = 0;
     RegionType = 0;
 
 	UseTables = false;
+	ResampleQuality = SAMPLE_QUALITY_NONE;
+	SampleThreads = 0;
 	VerboseLog = false;
+	LockChannels = false;
+	LoopWholeTrack = false;
+	PALMode = false;
+	InstrumentOffset = 0;
+	OutputFiles = NULL;
+	Pool = NULL;
+	SampleCache = NULL;
+	Offsets = NULL;
+	TrackIndex = 0;
+	PoolTurnTaken = false;
+	OffsetTurnTaken = false;
+	for(int i = 0; i < 256; i++)
+		PoolMap[i] = i;
 
     //NoiseMode = PSG_WHITE_NOISE_HI;
     for(int i=0; i<10; i++)
@@ -63,6 +142,8 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
         Channels[i].EffectCount = 0;
         Channels[i].Note = 0;
         Channels[i].Octave = 0;
+        Channels[i].LastNote = 0;
+        Channels[i].LastOctave = 0;
         Channels[i].ToneFreq = 0;
         Channels[i].NoteFreq = 0;
         Channels[i].LastFreq = 0;
@@ -73,6 +154,8 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
 		Channels[i].LastVolume = 0x7f;
         Channels[i].NewVolume = 0;
         Channels[i].SubtickFX = 0;
+        Channels[i].EffectVolume = 0x7f;
+        Channels[i].m_effectVibrato.VibratoFineDepth = 0x0f;
         LoopState[i] = Channels[i];
     }
 
@@ -83,6 +166,10 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
 
     DACEnabled = 0;
     PSGNoiseFreq = 0;
+    PSGPeriodicNoise = 0;
+
+    Memoize = true;
+    NumMemoHits = 0;
 
     return;
 }
@@ -90,182 +177,346 @@ DMFConverter::DMFConverter(ESFOutput ** esfout) // ctor
 DMFConverter::~DMFConverter() // dtor
 {
     /* Free any allocated memory */
-    delete [] PatternList;
+    m_arena.Release();
     return;
 }
 
-/** @brief Initializes module **/
-bool DMFConverter::Initialize(const char* Filename)
+/** Read-only view of a whole file, memory mapped */
+class MappedFile
 {
-    /* Open file */
-    streampos   file_size;
-    ifstream file (Filename, ios::in|ios::binary|ios::ate);
-    if (file.is_open())
-    {
-		if(VerboseLog)
+public:
+	MappedFile(const char* Filename)
+	{
+		m_open = false;
+		m_data = NULL;
+		m_size = 0;
+
+#ifdef _WIN32
+		m_mapping = NULL;
+		m_file = CreateFileA(Filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(m_file == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(m_file, &size);
+		m_size = (size_t)size.QuadPart;
+		m_open = true;
+
+		if(m_size > 0)
 		{
-			fprintf(stderr, "Loading file: %s\n", Filename);
+			m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if(m_mapping)
+				m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+			m_open = (m_data != NULL);
 		}
+#else
+		int fd = open(Filename, O_RDONLY);
+		if(fd < 0)
+			return;
 
-        file_size = file.tellg();
-        comp_data = new char [file_size];
-        file.seekg (0, ios::beg);
-        file.read (comp_data, file_size);
-        file.close();
+		struct stat st;
+		if(fstat(fd, &st) == 0)
+		{
+			m_size = (size_t)st.st_size;
+			m_open = true;
 
-		uLong comp_size_max = 16777216;
-		uLong comp_size = comp_size_max;
-        data.resize(comp_size);
+			if(m_size > 0)
+			{
+				void* ptr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(ptr != MAP_FAILED)
+					m_data = (const uint8_t*)ptr;
+				m_open = (m_data != NULL);
+			}
+		}
+		close(fd);
+#endif
+	}
 
-        /* Decompress the file with miniz */
-        int res;
-        #if DEBUG
-            fprintf(stdout, "decompression buffer: %lu, original filesize: %d\n", comp_size, (int)file_size);
-        #endif
-        res = uncompress((Byte*) &data[0], &comp_size, (Byte*) comp_data, file_size);
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if(m_data)
+			UnmapViewOfFile(m_data);
+		if(m_mapping)
+			CloseHandle(m_mapping);
+		if(m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+#else
+		if(m_data)
+			munmap((void*)m_data, m_size);
+#endif
+	}
 
-		if(comp_size >= comp_size_max)
-		{
-			fprintf(stderr, "Buffer overflow (%u/%u bytes)", (uint32_t)comp_size, (uint32_t)comp_size_max);
-		}
-		else if(res != Z_OK)
+	bool IsOpen() const { return m_open; }
+	const uint8_t* GetData() const { return m_data; }
+	size_t GetSize() const { return m_size; }
+
+private:
+	bool m_open;
+	const uint8_t* m_data;
+	size_t m_size;
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#endif
+};
+
+/** @brief Reads and decompresses a DMF file **/
+bool LoadDMF(const char* Filename, std::vector<uint8_t>& data, bool VerboseLog)
+{
+    /* Open file */
+    MappedFile file(Filename);
+    if (!file.IsOpen())
+    {
+        fprintf(stderr, "File not found: %s\n", Filename);
+        return 1;
+    }
+
+	if(VerboseLog)
+	{
+		fprintf(stderr, "Loading file: %s\n", Filename);
+	}
+
+    return InflateDMF(file.GetData(), file.GetSize(), data);
+}
+
+/** @brief Decompresses a DMF module already in memory **/
+bool InflateDMF(const uint8_t* dmfData, size_t dmfSize, std::vector<uint8_t>& data)
+{
+    /* Decompress the file with miniz, growing the buffer until the whole module fits */
+    tinfl_decompressor inflator;
+    tinfl_init(&inflator);
+
+    size_t in_offset = 0;
+    size_t out_size = 0;
+    data.resize(std::max<size_t>(dmfSize * 4, 65536));
+
+    #if DEBUG
+        fprintf(stdout, "decompression buffer: %lu, original filesize: %lu\n", (unsigned long)data.size(), (unsigned long)dmfSize);
+    #endif
+
+    tinfl_status res;
+    for(;;)
+    {
+        size_t in_bytes = dmfSize - in_offset;
+        size_t out_bytes = data.size() - out_size;
+
+        res = tinfl_decompress(&inflator, dmfData + in_offset, &in_bytes, &data[0], &data[out_size], &out_bytes,
+                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+
+        in_offset += in_bytes;
+        out_size += out_bytes;
+
+        if(res != TINFL_STATUS_HAS_MORE_OUTPUT)
+            break;
+
+        data.resize(data.size() * 2);
+    }
+
+    //The buffer grew in steps, hand back what the module doesn't use
+    data.resize(out_size);
+    data.shrink_to_fit();
+
+    if(res != TINFL_STATUS_DONE)
+    {
+        fprintf(stderr, "Failed to uncompress: Invalid or corrupted module?\n");
+        return 1;
+    }
+
+    /* Decompression successful, now check the DMF magic */
+    if(data.size() < DMFFile::sFormatStringSize || memcmp(&data[0], ".DelekDefleMask.", DMFFile::sFormatStringSize))
+    {
+        fprintf(stderr, "Not a valid DefleMask module.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/** @brief Gets the instrument and sample counts of a DMF file without building the module. The
+    sample count comes after the patterns, so the whole module is inflated, but only for as long as
+    the scan takes. Serialise only takes views of the pattern and sample data. **/
+bool ScanDMF(const char* Filename, uint8_t& numInstruments, uint8_t& numSamples)
+{
+	std::vector<uint8_t> data;
+	if(LoadDMF(Filename, data))
+		return 1;
+
+	DMFFile dmfFile;
+	Stream stream((char*)&data[0], data.size());
+	stream.Serialise(dmfFile);
+	if(stream.Failed())
+	{
+		fprintf(stderr, "Invalid or truncated module: %s\n", Filename);
+		return 1;
+	}
+
+	numInstruments = dmfFile.m_numInstruments;
+	numSamples = dmfFile.m_numSamples;
+	return 0;
+}
+
+/** @brief Initializes module **/
+bool DMFConverter::Initialize(const char* Filename)
+{
+    if(LoadDMF(Filename, data, VerboseLog))
+        return 1;
+
+    return InitializeModule();
+}
+
+/** @brief Initializes module from compressed DMF data in memory **/
+bool DMFConverter::Initialize(const uint8_t* dmfData, size_t dmfSize)
+{
+    if(InflateDMF(dmfData, dmfSize, data))
+        return 1;
+
+    return InitializeModule();
+}
+
+/** @brief Builds the module from the uncompressed data and writes instruments and samples **/
+bool DMFConverter::InitializeModule()
+{
+	//Create stream and serialise file, nothing past this point checks the module's counts again
+	Stream stream((char*)&data[0], data.size());
+	stream.Serialise(m_dmfFile);
+	if(stream.Failed())
+	{
+		fprintf(stderr, "Invalid or truncated module.\n");
+		return 1;
+	}
+
+    #if DEBUG
+        fprintf(stdout, "Module version: %x\n", (int) m_dmfFile.m_fileVersion);
+		fprintf(stdout, "System: %x\n", (int) m_dmfFile.m_systemType);
+    #endif
+    /* Get the DMF system. */
+	System = (DMFSystem)m_dmfFile.m_systemType;
+    if(System == DMF_SYSTEM_GENESIS)
+    {
+        /* This is a Genesis module */
+        ChannelCount = 10;
+        for(int i=0;i<ChannelCount;i++)
         {
-            fprintf(stderr, "Failed to uncompress: ");
-            if(res == Z_MEM_ERROR)
-                fprintf(stderr, "Not enough memory.\n");
-            else if(res == Z_BUF_ERROR)
-                fprintf(stderr, "Not enough room in the output buffer.\n");
-            else
-                fprintf(stderr, "Invalid or corrupted module?\n");
-            return 1;
+            Channels[i].Id = MDChannels[i].aChannelId;
+            Channels[i].Type = MDChannels[i].aChannelType;
+            Channels[i].ESFId = MDChannels[i].aESFChannel;
         }
-        else
+    }
+    else if(System == DMF_SYSTEM_SMS)
+    {
+        fprintf(stderr, "Master System module support is untested.\n");
+        /* This is a Master System module */
+        ChannelCount = 4;
+        for(int i=0;i<ChannelCount;i++)
         {
-            delete [] comp_data;
-
-			//Create stream and serialise file
-			Stream stream((char*)&data[0]);
-			stream.Serialise(m_dmfFile);
-
-            /* Decompression successful, now parse the DMF metadata */
-            char DefleMagic[17];
-            memcpy(DefleMagic, &data[0], 16);
-            DefleMagic[16] = 0;
-            res = strcmp(DefleMagic, ".DelekDefleMask.");
-            if(res)
-            {
-                fprintf(stderr, "Not a valid DefleMask module.\n");
-                return 1;
-            }
-            #if DEBUG
-                fprintf(stdout, "Module version: %x\n", (int) m_dmfFile.m_fileVersion);
-				fprintf(stdout, "System: %x\n", (int) m_dmfFile.m_systemType);
-            #endif
-            /* Get the DMF system. */
-			System = (DMFSystem)m_dmfFile.m_systemType;
-            if(System == DMF_SYSTEM_GENESIS)
-            {
-                /* This is a Genesis module */
-                ChannelCount = 10;
-                for(int i=0;i<ChannelCount;i++)
-                {
-                    Channels[i].Id = MDChannels[i].aChannelId;
-                    Channels[i].Type = MDChannels[i].aChannelType;
-                    Channels[i].ESFId = MDChannels[i].aESFChannel;
-                }
-            }
-            else if(System == DMF_SYSTEM_SMS)
-            {
-                fprintf(stderr, "Master System module support is untested.\n");
-                /* This is a Master System module */
-                ChannelCount = 4;
-                for(int i=0;i<ChannelCount;i++)
-                {
-                    Channels[i].Id = SMSChannels[i].aChannelId;
-                    Channels[i].Type = SMSChannels[i].aChannelType;
-                    Channels[i].ESFId = SMSChannels[i].aESFChannel;
-                }
-            }
-            else
-            {
-                fprintf(stderr, "Only Sega Genesis modules are supported.\n"); // Bug: Should obviously be 'Mega Drive modules'
-            }
+            Channels[i].Id = SMSChannels[i].aChannelId;
+            Channels[i].Type = SMSChannels[i].aChannelType;
+            Channels[i].ESFId = SMSChannels[i].aESFChannel;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Only Sega Genesis modules are supported.\n"); // Bug: Should obviously be 'Mega Drive modules'
+    }
 
-            /* Extract useful module metadata */
-			TickBase = m_dmfFile.m_timeBase;
-			TickTimeEvenRow = m_dmfFile.m_tickTimeEven;
-			TickTimeOddRow = m_dmfFile.m_tickTimeOdd;
-			RegionType = m_dmfFile.m_framesMode;
-			// custom HZ is ignored (4, 5, 6, 7)
-			TotalRowsPerPattern = m_dmfFile.m_numNoteRowsPerPattern;
-			TotalPatterns = m_dmfFile.m_numPatternPages;
-			ArpTickSpeed = m_dmfFile.m_arpeggioTickSpeed;
-			TotalInstruments = m_dmfFile.m_numInstruments;
-			TotalSamples = m_dmfFile.m_numSamples;
-
-			for(int i = 0; i < m_dmfFile.m_numInstruments; i++)
-			{
-				char filename[FILENAME_MAX] = { 0 };
-				if(m_dmfFile.m_instruments[i].m_mode == DMFFile::INSTRUMENT_FM)
-				{
-					//sprintf_s(filename, FILENAME_MAX, "instr_FM_%02x_%s.eif", i + InstrumentOffset, m_dmfFile.m_instruments[i].m_name.c_str());
-					snprintf(filename, FILENAME_MAX, "instr_%02x.eif", i + InstrumentOffset);
-				}
-				else
-				{
-					//sprintf_s(filename, FILENAME_MAX, "instr_PSG_%02x_%s.eif", i + InstrumentOffset, m_dmfFile.m_instruments[i].m_name.c_str());
-					snprintf(filename, FILENAME_MAX, "instr_%02x.eif", i + InstrumentOffset);
-				}
+    /* Extract useful module metadata */
+	TickBase = m_dmfFile.m_timeBase;
+	TickTimeEvenRow = m_dmfFile.m_tickTimeEven;
+	TickTimeOddRow = m_dmfFile.m_tickTimeOdd;
+	RegionType = m_dmfFile.m_framesMode;
+	// custom HZ is ignored (4, 5, 6, 7)
+	TotalRowsPerPattern = m_dmfFile.m_numNoteRowsPerPattern;
+	TotalPatterns = m_dmfFile.m_numPatternPages;
+	ArpTickSpeed = m_dmfFile.m_arpeggioTickSpeed;
+	TotalInstruments = m_dmfFile.m_numInstruments;
+	TotalSamples = m_dmfFile.m_numSamples;
+
+	//Under -j the offset carries over from the tracks before, which only know it once they get here
+	if(Offsets)
+	{
+		InstrumentOffset = Offsets->Claim(TrackIndex, TotalInstruments + TotalSamples);
+		esf->InstrumentOffset = InstrumentOffset;
+		OffsetTurnTaken = true;
+	}
 
-				OutputInstrument(i, filename);
-			}
+	//With a pool, collect everything first and only write what the pool hasn't seen
+	std::vector<OutputFile> pooledFiles;
+	std::vector<OutputFile>* outputFiles = OutputFiles;
+	if(Pool)
+		OutputFiles = &pooledFiles;
 
-			for(int i = 0; i < m_dmfFile.m_numSamples; i++)
-			{
-				char filename[FILENAME_MAX] = { 0 };
-				snprintf(filename, FILENAME_MAX, "instr_%02x.ewf", i + TotalInstruments + InstrumentOffset);
-				OutputSample(i, filename, false);
-			}
+	for(int i = 0; i < m_dmfFile.m_numInstruments; i++)
+	{
+		char filename[FILENAME_MAX] = { 0 };
+		if(m_dmfFile.m_instruments[i].m_mode == DMFFile::INSTRUMENT_FM)
+		{
+			//sprintf_s(filename, FILENAME_MAX, "instr_FM_%02x_%s.eif", i + InstrumentOffset, m_dmfFile.m_instruments[i].m_name.c_str());
+			snprintf(filename, FILENAME_MAX, "instr_%02x.eif", i + InstrumentOffset);
+		}
+		else
+		{
+			//sprintf_s(filename, FILENAME_MAX, "instr_PSG_%02x_%s.eif", i + InstrumentOffset, m_dmfFile.m_instruments[i].m_name.c_str());
+			snprintf(filename, FILENAME_MAX, "instr_%02x.eif", i + InstrumentOffset);
+		}
+
+		OutputInstrument(i, filename);
+	}
+
+	OutputSamples(ResampleQuality);
+
+	if(Pool)
+	{
+		OutputFiles = outputFiles;
+		if(AddToPool(pooledFiles))
+			return 1;
+	}
+
+    /* Finally build the pattern offset table */
+    PatternData = m_arena.Alloc<uint32_t>(ChannelCount);
+
+    /* Unpack the patterns into columns for the row interpreter */
+    m_patterns.Build(m_dmfFile, ChannelCount, m_arena);
+
+    /* Get some pattern data */
+    for(int i=0;i<ChannelCount;i++)
+    {
+		const PatternStore::Column& column = m_patterns.m_columns[i];
+		Channels[i].EffectCount = column.m_numEffects;
+		PatternData[i] = m_dmfFile.m_channels[i].m_patternData - &data[0];
+
+        /* Check for backwards jumps */
+        for(CurrPattern=0;CurrPattern<TotalPatterns;CurrPattern++)
+        {
+            if(!(column.GetSlotFlags(CurrPattern) & PatternStore::SLOT_HAS_JUMP))
+                continue;
 
-            /* Finally build the pattern offset table */
-            PatternData = new uint32_t[ChannelCount];
+            m_patterns.LoadColumn(i, CurrPattern);
 
-            /* Get some pattern data */
-            for(int i=0;i<ChannelCount;i++)
+            for(CurrRow=0;CurrRow<TotalRowsPerPattern;CurrRow++)
             {
-				Channels[i].EffectCount = m_dmfFile.m_channels[i].m_numEffects;
+                if(!column.HasEffects(CurrRow))
+                    continue;
 
-                /* Check for backwards jumps */
-                for(CurrPattern=0;CurrPattern<TotalPatterns;CurrPattern++)
+                const PatternStore::Effect* effects = column.GetEffects(CurrRow);
+                uint8_t EffectCounter;
+                for(EffectCounter=0;EffectCounter<Channels[i].EffectCount;EffectCounter++)
                 {
-                    for(CurrRow=0;CurrRow<TotalRowsPerPattern;CurrRow++)
+					uint8_t EffectType = effects[EffectCounter].m_type;
+					uint8_t EffectParam = effects[EffectCounter].m_value;
+					if(EffectType == EFFECT_TYPE_JUMP) // jump
                     {
-                        uint8_t EffectCounter;
-                        for(EffectCounter=0;EffectCounter<Channels[i].EffectCount;EffectCounter++)
+                        if(EffectParam <= CurrPattern && LoopFound == false)
                         {
-							uint8_t EffectType = m_dmfFile.m_channels[i].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectType;
-							uint8_t EffectParam = m_dmfFile.m_channels[i].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectValue;
-							if(EffectType == EFFECT_TYPE_JUMP) // jump
-                            {
-                                if(EffectParam <= CurrPattern && LoopFound == false)
-                                {
-                                    LoopFound = true;
-                                    LoopPattern = EffectParam;
-                                    LoopRow = 0;
-									fprintf(stdout, "Loop from pattern %x to %x\n", (int)CurrPattern, (int)LoopPattern);
-                                }
-                            }
+                            LoopFound = true;
+                            LoopPattern = EffectParam;
+                            LoopRow = 0;
+							fprintf(stdout, "Loop from pattern %x to %x\n", (int)CurrPattern, (int)LoopPattern);
                         }
                     }
                 }
             }
         }
     }
-    else
-    {
-        fprintf(stderr, "File not found: %s\n", Filename);
-        return 1;
-    }
     return 0;
 }
 
@@ -279,23 +530,13 @@ bool DMFConverter::Parse()
 
 	esf->WaitCounter = 0;
 
+	Frequencies = PALMode ? &PALFrequencies : &NTSCFrequencies;
+
 	//Determine used channels
 	for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
 	{
-		bool Used = false;
-
-		for(CurrPattern = 0; CurrPattern < TotalPatterns && !Used; CurrPattern++)
-		{
-			for(CurrRow = 0; CurrRow < TotalRowsPerPattern && !Used; CurrRow++)
-			{
-				uint16_t note = m_dmfFile.m_channels[CurrChannel].m_patternPages[CurrPattern].m_notes[CurrRow].m_note;
-				if(note != 0 && note != NOTE_OFF)
-				{
-					UsedChannels.insert(CurrChannel);
-					Used = true;
-				}
-			}
-		}
+		if(m_patterns.m_columns[CurrChannel].m_hasNotes)
+			UsedChannels.insert(CurrChannel);
 	}
 
 	if(PALMode)
@@ -326,6 +567,29 @@ bool DMFConverter::Parse()
         #endif
         CurrRow = NextRow;
         NextRow = 0;
+
+        //A pattern seen before with the same state gives the same output, replay it
+        bool memoize = Memoize && CanMemoize(CurrPattern);
+        std::string memoKey;
+        size_t firstEvent = 0;
+        if(memoize)
+        {
+            memoKey = GetMemoKey(CurrPattern, CurrRow);
+
+            std::unordered_map<std::string, PatternMemo>::iterator it = PatternMemos.find(memoKey);
+            if(it != PatternMemos.end())
+            {
+                esf->ReplayEvents(it->second.m_events, CurrPattern);
+                RestoreState(it->second.m_exitState);
+                NumMemoHits++;
+                continue;
+            }
+
+            firstEvent = esf->GetNumEvents();
+        }
+
+        m_patterns.LoadPage(CurrPattern);
+
         for(CurrRow=CurrRow;CurrRow<TotalRowsPerPattern;CurrRow++)
         {
             #if MODDATA
@@ -338,14 +602,10 @@ bool DMFConverter::Parse()
 				esf->SetLoop();
 
             /* Parse pattern data */
-			for(uint8_t CurrChannel = 0; CurrChannel<ChannelCount; CurrChannel++)
+			if(this->ParseRow(CurrPattern, CurrRow))
             {
-				if(this->ParseChannelRow(CurrChannel, CurrPattern, CurrRow))
-                {
-                    fprintf(stderr, "Could not parse module data.\n");
-                    return 1;
-                }
-                //fprintf(stdout, "%#x, ", ChannelData);
+                fprintf(stderr, "Could not parse module data.\n");
+                return 1;
             }
 
             #if MODDATA
@@ -355,70 +615,34 @@ bool DMFConverter::Parse()
             //Calculate number of ticks per row - Deflemask exports 1 tick time for even rows, and another for odd rows
 			uint8_t ticksPerRow = (CurrRow & 1) ? (TickTimeOddRow*(TickBase + 1)) : ( TickTimeEvenRow*(TickBase + 1));
 
-			//Increment delay counter, will be used and cleared on next command
-            esf->WaitCounter += ticksPerRow;
-
-			//Process at least one active effect tick, and continue whilst idle (waitCounter > 0)
-			int numEffectsProcessed = 0;
-			do
+			//Run the active effects on every tick of the row, tick 0 being the row itself. Once
+			//nothing is left running the rest of the row is a plain delay
+			for(uint8_t tick = 0; tick < ticksPerRow; tick++)
 			{
-				numEffectsProcessed = 0;
-
-				//Check if any effects need processing
-				bool processEffects = false;
-				bool wholeDelay = false;
-				bool noteOn = false;
+				int numEffectsProcessed = 0;
 				for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
 				{
-					EffectStage stage = GetActiveEffectStage(CurrChannel);
-					if(stage != EFFECT_STAGE_OFF)
-					{
-						processEffects = true;
-
-						if(stage == EFFECT_STAGE_INITIALISE)
-						{
-							//First use of effect, delay treated as note on
-							wholeDelay = true;
-						}
-
-						if(Channels[CurrChannel].m_effectPortmento.NoteOnthisTick)
-						{
-							noteOn = true;
-						}
-					}
+					numEffectsProcessed += ProcessActiveEffects(CurrChannel, tick);
 				}
 
-				if(processEffects)
+				if(!numEffectsProcessed)
 				{
-					//If note on this row, don't process any delay
-					if(!noteOn)
-					{
-						if(wholeDelay)
-						{
-							//First tick for at least one of the effects, process whole delay
-							esf->Wait();
-						}
-						else
-						{
-							//Subsequent tick, delay by 1
-							uint32_t oldDelay = esf->WaitCounter;
-							esf->WaitCounter = 1;
-							esf->Wait();
-							esf->WaitCounter = oldDelay;
-						}
-					}
+					esf->WaitCounter += ticksPerRow - tick;
+					break;
+				}
 
-					for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
-					{
-						numEffectsProcessed += ProcessActiveEffects(CurrChannel);
-					}
+				//Delay counter is used and cleared on next command
+				esf->WaitCounter += 1;
+			}
 
-					if(numEffectsProcessed && esf->WaitCounter > 0)
-					{
-						esf->WaitCounter -= 1;
-					}
-				}
-			} while(esf->WaitCounter > 0 && numEffectsProcessed > 0);
+			//Effects that only last for their row
+			for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
+			{
+				Channels[CurrChannel].NoteOnThisRow = false;
+				Channels[CurrChannel].m_effectNoteCut.NoteCut = EFFECT_OFF;
+				Channels[CurrChannel].m_effectRetrigger.Retrig = EFFECT_OFF;
+				Channels[CurrChannel].m_effectNoteDelay.NoteDelay = EFFECT_OFF;
+			}
 
             /* Are we at the loop end? If so, start playing the loop row */
             if(LoopFlag == true)
@@ -426,11 +650,8 @@ bool DMFConverter::Parse()
                 #if MODDATA
                     fprintf(stdout, "Loop:    ");
                 #endif
-					for(uint8_t CurrChannel=0;CurrChannel<ChannelCount;CurrChannel++)
-                {
-                    if(this->ParseChannelRow(CurrChannel, CurrPattern, CurrRow))
-                        return 1;
-                }
+                if(this->ParseRow(CurrPattern, CurrRow))
+                    return 1;
                 #if MODDATA
                     fprintf(stdout, "\n");
                 #endif
@@ -448,8 +669,20 @@ bool DMFConverter::Parse()
         }
         if(LoopFlag == true)
             break;
+
+        if(memoize)
+        {
+            PatternMemo& memo = PatternMemos[memoKey];
+            esf->GetEvents(firstEvent, memo.m_events);
+            SaveState(memo.m_exitState);
+        }
     }
 
+	if(VerboseLog)
+	{
+		fprintf(stdout, "Reused %i of %i converted patterns\n", NumMemoHits, NumMemoHits + (int)PatternMemos.size());
+	}
+
 	if(LoopWholeTrack)
 	{
 		esf->GotoLoop();
@@ -459,97 +692,308 @@ bool DMFConverter::Parse()
 
     return 0;
 }
-/** @brief Parses pattern data for a single channel **/
-bool DMFConverter::ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t CurrRow)
+/** @brief Returns true if the output of an order position only depends on its patterns, start row
+    and ParseState. Jumps, breaks and the loop point depend on the order position itself. **/
+bool DMFConverter::CanMemoize(uint32_t CurrPattern)
 {
-	Channel& channel = Channels[chan];
+	if(LoopFound && LoopPattern == CurrPattern)
+		return false;
 
-	//Calculate number of ticks per row - Deflemask exports 1 tick time for even rows, and another for odd rows
-	uint8_t ticksPerRow = (CurrRow & 1) ? (TickTimeOddRow * (TickBase + 1)) : (TickTimeEvenRow * (TickBase + 1));
+	return !m_patterns.HasSlotFlags(CurrPattern, PatternStore::SLOT_HAS_JUMP | PatternStore::SLOT_HAS_BREAK);
+}
 
-    uint8_t EffectCounter;
-    uint8_t EffectType;
-    uint8_t EffectParam;
+void DMFConverter::SaveState(ParseState& state)
+{
+	memset((void*)&state, 0, sizeof(state));
+	memcpy(state.m_channels, Channels, sizeof(state.m_channels));
+	state.m_waitCounter = esf->WaitCounter;
+	state.m_tickBase = TickBase;
+	state.m_tickTimeEvenRow = TickTimeEvenRow;
+	state.m_tickTimeOddRow = TickTimeOddRow;
+	state.m_DACEnabled = DACEnabled;
+	state.m_PSGNoiseFreq = PSGNoiseFreq;
+	state.m_PSGPeriodicNoise = PSGPeriodicNoise;
+}
 
-    /* Clean up effects */
-    Channels[chan].m_effectNoteCut.NoteCut = EFFECT_OFF;
-    Channels[chan].m_effectNoteDelay.NoteDelay = EFFECT_OFF;
+void DMFConverter::RestoreState(const ParseState& state)
+{
+	memcpy(Channels, state.m_channels, sizeof(state.m_channels));
+	esf->WaitCounter = state.m_waitCounter;
+	TickBase = state.m_tickBase;
+	TickTimeEvenRow = state.m_tickTimeEvenRow;
+	TickTimeOddRow = state.m_tickTimeOddRow;
+	DACEnabled = state.m_DACEnabled;
+	PSGNoiseFreq = state.m_PSGNoiseFreq;
+	PSGPeriodicNoise = state.m_PSGPeriodicNoise;
+}
 
-    /* Get row data */
-	Channels[chan].Note = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_note;
-	Channels[chan].Octave = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_octave;
-	Channels[chan].NewVolume = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_volume;
-	Channels[chan].NewInstrument = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_instrument;
+/** @brief Appends a value's bytes to a memo key */
+template <typename T> static void AppendKey(std::string& key, T value)
+{
+	key.append((const char*)&value, sizeof(value));
+}
 
-	uint8_t nextNote = 0;
-	uint8_t nextOctave = 0;
+/** @brief Appends what a channel's later output depends on to a memo key. Padding and row-scoped
+    state, the current cell and note delay, cut and retrigger, are left out so equal states match. **/
+static void AppendChannelKey(std::string& key, const Channel& channel)
+{
+	AppendKey(key, (uint8_t)channel.Type);
+	AppendKey(key, (uint8_t)channel.ESFId);
+	AppendKey(key, channel.EffectCount);
+
+	//Frequencies are whole numbers, key them by value
+	AppendKey(key, (int32_t)channel.NoteFreq);
+	AppendKey(key, (int32_t)channel.ToneFreq);
+	AppendKey(key, channel.LastNote);
+	AppendKey(key, channel.LastOctave);
+	AppendKey(key, channel.LastFreq);
+	AppendKey(key, channel.NewFreq);
+	AppendKey(key, channel.Instrument);
+	AppendKey(key, channel.Volume);
+	AppendKey(key, channel.LastVolume);
+	AppendKey(key, channel.Pitch);
+	AppendKey(key, channel.EffectFreq);
+	AppendKey(key, channel.EffectVolume);
+
+	const EffectArpeggio& arp = channel.m_effectArpeggio;
+	AppendKey(key, (uint8_t)arp.Arp);
+	AppendKey(key, arp.Arp1);
+	AppendKey(key, arp.Arp2);
+	AppendKey(key, arp.ArpCounter);
+
+	const EffectPortmento& porta = channel.m_effectPortmento;
+	AppendKey(key, (uint8_t)porta.Porta);
+	AppendKey(key, porta.PortaSpeed);
+
+	const EffectPortaNote& portaNote = channel.m_effectPortaNote;
+	AppendKey(key, (uint8_t)portaNote.PortaNote);
+	AppendKey(key, portaNote.PortaNoteActive);
+	AppendKey(key, portaNote.PortaNoteSpeed);
+	AppendKey(key, portaNote.PortaNoteCurrentNote);
+	AppendKey(key, portaNote.PortaNoteTargetNote);
+	AppendKey(key, portaNote.PortaNoteCurrentOctave);
+	AppendKey(key, portaNote.PortaNoteTargetOctave);
+
+	const EffectVibrato& vibrato = channel.m_effectVibrato;
+	AppendKey(key, (uint8_t)vibrato.Vibrato);
+	AppendKey(key, vibrato.VibratoActive);
+	AppendKey(key, vibrato.VibratoFineDepth);
+	AppendKey(key, vibrato.VibratoDepth);
+	AppendKey(key, vibrato.VibratoSpeed);
+	AppendKey(key, vibrato.VibratoOffset);
+	AppendKey(key, vibrato.VibratoMode);
+
+	const EffectTremolo& tremolo = channel.m_effectTremolo;
+	AppendKey(key, (uint8_t)tremolo.Tremolo);
+	AppendKey(key, tremolo.TremoloActive);
+	AppendKey(key, tremolo.TremoloDepth);
+	AppendKey(key, tremolo.TremoloSpeed);
+	AppendKey(key, tremolo.TremoloOffset);
+
+	const EffectVolSlide& volSlide = channel.m_effectVolSlide;
+	AppendKey(key, (uint8_t)volSlide.VolSlide);
+	AppendKey(key, volSlide.VolSlideValue);
+	AppendKey(key, volSlide.CurrVol);
+
+	const EffectNoteSlide& noteSlide = channel.m_effectNoteSlide;
+	AppendKey(key, (uint8_t)noteSlide.NoteSlide);
+	AppendKey(key, noteSlide.NoteSlideSpeed);
+	AppendKey(key, noteSlide.NoteSlideFinal);
+	AppendKey(key, noteSlide.NoteSlideTarget);
+}
 
-	if(CurrRow < m_dmfFile.m_numNoteRowsPerPattern - 1)
+/** @brief Identifies an order position by its channels' pattern slots and start row, plus the state
+    it is entered with **/
+std::string DMFConverter::GetMemoKey(uint32_t CurrPattern, uint32_t CurrRow)
+{
+	std::string key;
+	for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
 	{
-		nextNote = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow + 1].m_note;
-		nextOctave = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow + 1].m_octave;
+		key.push_back(m_patterns.m_columns[CurrChannel].m_pageSlots[CurrPattern]);
 	}
+	key.push_back(CurrRow);
 
-    /* Instrument updated? */
-    if(Channels[chan].NewInstrument != Channels[chan].Instrument && Channels[chan].NewInstrument != 0xff)
-    {
-        Channels[chan].Instrument = Channels[chan].NewInstrument;
-        if(UseTables)
-            esf->SetInstrument(Channels[chan].ESFId,InstrumentTable[Channels[chan].Instrument]);
-        else
-            esf->SetInstrument(Channels[chan].ESFId,Channels[chan].Instrument);
+	for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
+	{
+		AppendChannelKey(key, Channels[CurrChannel]);
+	}
 
-        /* Echo resets the volume if the instrument is changed (FM only...) */
-		if(Channels[chan].Type != CHANNEL_TYPE_PSG && Channels[chan].Type != CHANNEL_TYPE_PSG4)
-		{
-			Channels[chan].Volume = 0x7f;
-			Channels[chan].LastVolume = 0x7f;
-		}
-    }
+	AppendKey(key, esf->WaitCounter);
+	AppendKey(key, TickBase);
+	AppendKey(key, TickTimeEvenRow);
+	AppendKey(key, TickTimeOddRow);
+	AppendKey(key, DACEnabled);
+	AppendKey(key, PSGNoiseFreq);
+	AppendKey(key, PSGPeriodicNoise);
+	return key;
+}
 
-    /* Volume updated? */
-    if(Channels[chan].NewVolume != Channels[chan].Volume && Channels[chan].NewVolume != 0xff)
-    {
-        Channels[chan].Volume = Channels[chan].NewVolume;
-		Channels[chan].LastVolume = Channels[chan].NewVolume;
-        if(Channels[chan].Type == CHANNEL_TYPE_FM || CHANNEL_TYPE_FM6)
-            esf->SetVolume(Channels[chan].ESFId,(Channels[chan].Volume));
-        else if(Channels[chan].Type == CHANNEL_TYPE_PSG || CHANNEL_TYPE_PSG4)
-            esf->SetVolume(Channels[chan].ESFId,(Channels[chan].Volume));
-    }
+/** @brief Parses pattern data for all channels in a row. Empty cells only change state that is
+    overwritten before it is next read, so they are skipped. **/
+bool DMFConverter::ParseRow(uint32_t CurrPattern, uint32_t CurrRow)
+{
+	bool rowOccupied = m_patterns.IsRowOccupied(CurrRow);
 
-    /* Parse some effects before any note ons */
-    for(EffectCounter=0;EffectCounter<Channels[chan].EffectCount;EffectCounter++)
-    {
-		EffectType = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectType;
-		EffectParam = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectValue;
-		if(EffectType == EFFECT_TYPE_DAC_ON) // DAC enable
-        {
-            DACEnabled = 0;
+	for(uint8_t CurrChannel = 0; CurrChannel < ChannelCount; CurrChannel++)
+	{
+		const PatternStore::Column& column = m_patterns.m_columns[CurrChannel];
 
-            if(EffectParam > 0)
-                DACEnabled = 1;
+		//Channels with no data at all are never visited
+		if(!column.m_occupied)
+			continue;
 
-            //fprintf(stderr, "effect %02x%02x: DAC enable %d\n",(int)EffectType,(int)EffectParam,(int)DACEnabled);
-        }
-		else if(EffectType == EFFECT_TYPE_PSG_NOISE) // Set noise mode
-        {
-            PSGNoiseFreq = 0;
-            PSGPeriodicNoise = 0;
+		if(rowOccupied && column.IsOccupied(CurrRow))
+		{
+			if(this->ParseChannelRow(CurrChannel, CurrPattern, CurrRow))
+				return 1;
+		}
+	}
 
-            if(EffectParam & 0xF0)
-                PSGNoiseFreq = 1;
-            if(EffectParam & 0x0F)
-                PSGPeriodicNoise = 1;
+	return 0;
+}
 
-			if(VerboseLog)
-			{
-				fprintf(stdout, "psg val = %d %d\n", (int)PSGNoiseFreq, (int)PSGPeriodicNoise);
-			}
-            //fprintf(stderr, "effect %02x%02x: PSG noise mode %d %d\n",(int)EffectType,(int)EffectParam,(int)PSGNoiseFreq,(int)PSGPeriodicNoise);
-        }
+typedef void (DMFConverter::*EffectFunc)(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+
+struct EffectHandler
+{
+	EffectFunc m_funcs[EFFECT_PHASE_COUNT];     // NULL in phases the effect doesn't use
+	uint8_t m_phases;                           // bit per phase with a handler
+};
+
+/** Effect handlers by effect type, unknown and unsupported effects have none */
+struct EffectTable
+{
+	EffectTable()
+	{
+		memset((void*)m_handlers, 0, sizeof(m_handlers));
+
+		Register(EFFECT_TYPE_DAC_ON, EFFECT_PHASE_PRE_NOTE, &DMFConverter::OnDACEnable);
+		Register(EFFECT_TYPE_PSG_NOISE, EFFECT_PHASE_PRE_NOTE, &DMFConverter::OnPSGNoise);
+		Register(EFFECT_TYPE_PORTMENTO_TO_NOTE, EFFECT_PHASE_NOTE_ON, &DMFConverter::OnScheduleTonePortamento);
+		Register(EFFECT_TYPE_NOTE_DELAY, EFFECT_PHASE_NOTE_ON, &DMFConverter::OnScheduleNoteDelay);
+		Register(EFFECT_TYPE_ARPEGGIO, EFFECT_PHASE_ROW, &DMFConverter::OnArpeggio);
+		Register(EFFECT_TYPE_PORTMENTO_UP, EFFECT_PHASE_ROW, &DMFConverter::OnPortamento);
+		Register(EFFECT_TYPE_PORTMENTO_DOWN, EFFECT_PHASE_ROW, &DMFConverter::OnPortamento);
+		Register(EFFECT_TYPE_PAN, EFFECT_PHASE_ROW, &DMFConverter::OnPan);
+		Register(EFFECT_TYPE_SET_SPEED_1, EFFECT_PHASE_ROW, &DMFConverter::OnSetSpeed);
+		Register(EFFECT_TYPE_SET_SPEED_2, EFFECT_PHASE_ROW, &DMFConverter::OnSetSpeed);
+		Register(EFFECT_TYPE_VOLUME_SLIDE, EFFECT_PHASE_ROW, &DMFConverter::OnVolumeSlide);
+		Register(EFFECT_TYPE_PORTMENTO_TO_NOTE_AND_VOL_SLIDE, EFFECT_PHASE_ROW, &DMFConverter::OnVolumeSlide);
+		Register(EFFECT_TYPE_VIBRATO_AND_VOL_SLIDE, EFFECT_PHASE_ROW, &DMFConverter::OnVolumeSlide);
+		Register(EFFECT_TYPE_VIBTRATO, EFFECT_PHASE_ROW, &DMFConverter::OnVibrato);
+		Register(EFFECT_TYPE_SET_VIBRATO_MODE, EFFECT_PHASE_ROW, &DMFConverter::OnVibratoMode);
+		Register(EFFECT_TYPE_SET_FINE_VIBRATO, EFFECT_PHASE_ROW, &DMFConverter::OnFineVibratoDepth);
+		Register(EFFECT_TYPE_TREMOLO, EFFECT_PHASE_ROW, &DMFConverter::OnTremolo);
+		Register(EFFECT_TYPE_NOTE_SLIDE_UP, EFFECT_PHASE_ROW, &DMFConverter::OnNoteSlide);
+		Register(EFFECT_TYPE_NOTE_SLIDE_DOWN, EFFECT_PHASE_ROW, &DMFConverter::OnNoteSlide);
+		Register(EFFECT_TYPE_NOTE_RETRIGGER, EFFECT_PHASE_ROW, &DMFConverter::OnRetrigger);
+		Register(EFFECT_TYPE_NOTE_CUT, EFFECT_PHASE_ROW, &DMFConverter::OnNoteCut);
+		Register(EFFECT_TYPE_JUMP, EFFECT_PHASE_ROW, &DMFConverter::OnJump);
+		Register(EFFECT_TYPE_BREAK, EFFECT_PHASE_ROW, &DMFConverter::OnBreak);
+	}
+
+	void Register(uint8_t type, EffectPhase phase, EffectFunc func)
+	{
+		m_handlers[type].m_funcs[phase] = func;
+		m_handlers[type].m_phases |= 1 << phase;
+	}
+
+	EffectHandler m_handlers[256];
+};
+
+static const EffectTable sEffectTable;
+
+/** Effects that keep running after their row. Note restarts come first, then slides move the
+    pitch and volume before the offsets on top of them. */
+typedef int (DMFConverter::*TickEffectFunc)(uint8_t chan, uint8_t tick, TickOutput& output);
+
+static const TickEffectFunc sTickEffects[] =
+{
+	&DMFConverter::ProcessRetrigger,
+	&DMFConverter::ProcessNoteCut,
+	&DMFConverter::ProcessPortamento,
+	&DMFConverter::ProcessNoteSlide,
+	&DMFConverter::ProcessArpeggio,
+	&DMFConverter::ProcessVibrato,
+	&DMFConverter::ProcessVolumeSlide,
+	&DMFConverter::ProcessTremolo,
+};
+
+static const int sNumTickEffects = sizeof(sTickEffects) / sizeof(sTickEffects[0]);
+
+/** @brief Parses pattern data for a single channel **/
+bool DMFConverter::ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t CurrRow)
+{
+	Channel& channel = Channels[chan];
+
+    /* Clean up effects */
+    Channels[chan].m_effectNoteDelay.NoteDelay = EFFECT_OFF;
+
+    /* Get row data */
+	const PatternStore::Column& column = m_patterns.m_columns[chan];
+	Channels[chan].Note = column.m_notes[CurrRow];
+	Channels[chan].Octave = column.m_octaves[CurrRow];
+	Channels[chan].NewVolume = column.m_volumes[CurrRow];
+	Channels[chan].NewInstrument = column.m_instruments[CurrRow];
+
+	//Rows without effects skip the effect passes entirely
+	const PatternStore::Effect* effects = column.GetEffects(CurrRow);
+	uint8_t effectCount = column.HasEffects(CurrRow) ? Channels[chan].EffectCount : 0;
+
+	//Phases with nothing to do this row are skipped
+	uint8_t rowPhases = 0;
+	for(uint8_t effectIdx = 0; effectIdx < effectCount; effectIdx++)
+	{
+		rowPhases |= sEffectTable.m_handlers[effects[effectIdx].m_type].m_phases;
+	}
+
+	uint8_t nextNote = 0;
+	uint8_t nextOctave = 0;
+
+	if(CurrRow < m_dmfFile.m_numNoteRowsPerPattern - 1)
+	{
+		nextNote = column.m_notes[CurrRow + 1];
+		nextOctave = column.m_octaves[CurrRow + 1];
+	}
+
+    /* Instrument updated? */
+    if(Channels[chan].NewInstrument != Channels[chan].Instrument && Channels[chan].NewInstrument != 0xff)
+    {
+        Channels[chan].Instrument = Channels[chan].NewInstrument;
+        if(UseTables)
+            esf->SetInstrument(Channels[chan].ESFId,InstrumentTable[Channels[chan].Instrument]);
+        else if(Pool)
+            esf->SetInstrument(Channels[chan].ESFId,PoolMap[Channels[chan].Instrument]);
+        else
+            esf->SetInstrument(Channels[chan].ESFId,Channels[chan].Instrument);
+
+        /* Echo resets the volume if the instrument is changed (FM only...) */
+		if(Channels[chan].Type != CHANNEL_TYPE_PSG && Channels[chan].Type != CHANNEL_TYPE_PSG4)
+		{
+			Channels[chan].Volume = 0x7f;
+			Channels[chan].LastVolume = 0x7f;
+			Channels[chan].EffectVolume = 0x7f;
+			Channels[chan].m_effectVolSlide.CurrVol = 0x7f << 16;
+		}
+    }
+
+    /* Volume updated? */
+    if(Channels[chan].NewVolume != Channels[chan].Volume && Channels[chan].NewVolume != 0xff)
+    {
+        Channels[chan].Volume = Channels[chan].NewVolume;
+		Channels[chan].LastVolume = Channels[chan].NewVolume;
+		Channels[chan].EffectVolume = Channels[chan].NewVolume;
+		Channels[chan].m_effectVolSlide.CurrVol = Channels[chan].NewVolume << 16;
+        if(Channels[chan].Type == CHANNEL_TYPE_FM || Channels[chan].Type == CHANNEL_TYPE_FM6)
+            esf->SetVolume(Channels[chan].ESFId,(Channels[chan].Volume));
+        else if(Channels[chan].Type == CHANNEL_TYPE_PSG || Channels[chan].Type == CHANNEL_TYPE_PSG4)
+            esf->SetVolume(Channels[chan].ESFId,(Channels[chan].Volume));
     }
 
+    /* Parse some effects before any note ons */
+	if(rowPhases & (1 << EFFECT_PHASE_PRE_NOTE))
+		RunEffects(chan, effects, effectCount, EFFECT_PHASE_PRE_NOTE, CurrPattern);
+
     /* Is this a note off? */
 	if(Channels[chan].Note == NOTE_OFF)
     {
@@ -561,11 +1005,13 @@ bool DMFConverter::ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t
         Channels[chan].ToneFreq = 0;
         Channels[chan].LastFreq = 0;
         Channels[chan].NewFreq = 0;
+        Channels[chan].EffectFreq = 0;
 
 		//Turn off effects which stop at note off
 		channel.m_effectPortaNote.PortaNote = EFFECT_OFF;
-		channel.m_effectPortmento.Porta == EFFECT_OFF;
+		channel.m_effectPortmento.Porta = EFFECT_OFF;
 		channel.m_effectVolSlide.VolSlide = EFFECT_OFF;
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_OFF;
     }
     /* Note on? */
     else if(Channels[chan].Note != 0)
@@ -589,24 +1035,15 @@ bool DMFConverter::ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t
 		channel.m_effectPortaNote.PortaNote = EFFECT_OFF;
 		channel.m_effectPortmento.Porta = EFFECT_OFF;
 		channel.m_effectVolSlide.VolSlide = EFFECT_OFF;
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_OFF;
 
         /* Parse some effects that will affect the note on */
-        for(EffectCounter=0;EffectCounter<Channels[chan].EffectCount;EffectCounter++)
-        {
-			EffectType = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectType;
-			EffectParam = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectValue;
-            if(EffectType == 0x03) // Tone portamento.
-				Channels[chan].m_effectPortaNote.PortaNote = EFFECT_SCHEDULE;
-            else if(EffectType == 0xed) // Note delay.
-            {
-                Channels[chan].m_effectNoteDelay.NoteDelay = EFFECT_SCHEDULE;
-				Channels[chan].m_effectNoteDelay.NoteDelayOffset = EffectParam;
-            }
-        }
+		if(rowPhases & (1 << EFFECT_PHASE_NOTE_ON))
+			RunEffects(chan, effects, effectCount, EFFECT_PHASE_NOTE_ON, CurrPattern);
 
         /* If note delay or tone portamento is off, send the note on command already! */
 		if(Channels[chan].m_effectNoteDelay.NoteDelay == EFFECT_OFF || Channels[chan].m_effectPortaNote.PortaNote == EFFECT_OFF)
-            this->NoteOn(chan);
+            this->StartNote(chan);
     }
     /* Note column is empty */
     else {
@@ -619,275 +1056,428 @@ bool DMFConverter::ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t
     fprintf(stdout, "%02x %02x, ",(int)Channels[chan].NewVolume,(int)Channels[chan].NewInstrument);
     #endif
 
-	if(0) //Channels[chan].m_effectPortaNote.PortaNote != EFFECT_OFF)
+    //Process new effects
+	if(rowPhases & (1 << EFFECT_PHASE_ROW))
+		RunEffects(chan, effects, effectCount, EFFECT_PHASE_ROW, CurrPattern);
+
+    return 0;
+}
+
+/** @brief Runs the row's handlers for one phase, in effect column order **/
+void DMFConverter::RunEffects(uint8_t chan, const PatternStore::Effect* effects, uint8_t effectCount, EffectPhase phase, uint32_t CurrPattern)
+{
+	for(uint8_t effectIdx = 0; effectIdx < effectCount; effectIdx++)
 	{
-		//TODO: handle octave change
-		uint8_t currentNote = Channels[chan].m_effectPortaNote.PortaNoteCurrentNote;
-		uint8_t currentOctave = Channels[chan].m_effectPortaNote.PortaNoteCurrentOctave;
-		uint8_t targetNote = Channels[chan].m_effectPortaNote.PortaNoteTargetNote;
-		uint8_t targetOctave = Channels[chan].m_effectPortaNote.PortaNoteTargetOctave;
-		uint8_t speed = Channels[chan].m_effectPortaNote.PortaNoteSpeed;
+		EffectFunc func = sEffectTable.m_handlers[effects[effectIdx].m_type].m_funcs[phase];
+		if(func)
+			(this->*func)(chan, effects[effectIdx], CurrPattern);
+	}
+}
 
-		//Lerp towards target at speed
-		if((targetNote | targetOctave << 8) > (currentNote | currentOctave << 8))
-		{
-			currentNote += speed;
-			if(currentNote > targetNote)
-				currentNote = targetNote;
-		}
-		else if((targetNote | targetOctave << 8) < (currentNote | currentOctave << 8))
-		{
-			currentNote -= speed;
-			if(currentNote < targetNote)
-				currentNote = targetNote;
-		}
+void DMFConverter::OnDACEnable(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    DACEnabled = 0;
 
-		//If target reached, effect finished
-		if(currentNote == targetNote)
-		{
-			Channels[chan].m_effectPortaNote.PortaNote == EFFECT_OFF;
-		}
+    if(effect.m_value > 0)
+        DACEnabled = 1;
+
+}
+
+void DMFConverter::OnPSGNoise(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    PSGNoiseFreq = 0;
+    PSGPeriodicNoise = 0;
 
-		//Note on
-		Channels[chan].Note = currentNote;
-		NoteOn(chan);
+    if(effect.m_value & 0xF0)
+        PSGNoiseFreq = 1;
+    if(effect.m_value & 0x0F)
+        PSGPeriodicNoise = 1;
 
-		//Update effect history data
-		Channels[chan].m_effectPortaNote.PortaNoteCurrentNote = currentNote;
-		Channels[chan].m_effectPortaNote.PortaNoteCurrentOctave = currentOctave;
+	if(VerboseLog)
+	{
+		fprintf(stdout, "psg val = %d %d\n", (int)PSGNoiseFreq, (int)PSGPeriodicNoise);
 	}
+}
+
+void DMFConverter::OnScheduleTonePortamento(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channels[chan].m_effectPortaNote.PortaNote = EFFECT_SCHEDULE;
+}
+
+void DMFConverter::OnScheduleNoteDelay(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    Channels[chan].m_effectNoteDelay.NoteDelay = EFFECT_SCHEDULE;
+	Channels[chan].m_effectNoteDelay.NoteDelayOffset = effect.m_value;
+}
 
-	if(channel.m_effectVolSlide.VolSlide != EFFECT_OFF)
+void DMFConverter::OnArpeggio(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    if(effect.m_value != 0)
+    {
+        Channels[chan].m_effectArpeggio.Arp = EFFECT_NORMAL;
+		Channels[chan].m_effectArpeggio.Arp1 = effect.m_value >> 4;
+		Channels[chan].m_effectArpeggio.Arp2 = effect.m_value & 0x0f;
+    }
+    else
+    {
+		Channels[chan].m_effectArpeggio.Arp = EFFECT_OFF;
+    }
+}
+
+void DMFConverter::OnPortamento(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channel& channel = Channels[chan];
+
+	if(effect.m_value == 0)
 	{
-		int i = 0;
+		channel.m_effectPortmento.Porta = EFFECT_OFF;
+	}
+	else
+	{
+		channel.m_effectPortmento.Porta = effect.m_type == EFFECT_TYPE_PORTMENTO_UP ? EFFECT_UP : EFFECT_DOWN;
+		channel.m_effectPortmento.PortaSpeed = effect.m_value;
+	}
+}
 
-		for(i = 0; i < ticksPerRow && channel.m_effectVolSlide.VolSlide != EFFECT_OFF; i++)
-		{
-			//Calc current volume
-			channel.m_effectVolSlide.CurrVol = Clamp(channel.m_effectVolSlide.CurrVol + channel.m_effectVolSlide.VolSlideValue, 0, 0x7f);
+void DMFConverter::OnPan(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    if(Channels[chan].Type == CHANNEL_TYPE_FM || Channels[chan].Type == CHANNEL_TYPE_FM6)
+        esf->SetParams(Channels[chan].ESFId,(effect.m_value & 0x10)<<3 | (effect.m_value & 0x01)<<6);
+}
 
-			//Set volume (includes current delay)
-			esf->SetVolume(channel.ESFId, channel.m_effectVolSlide.CurrVol);
+void DMFConverter::OnSetSpeed(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    if(effect.m_type == EFFECT_TYPE_SET_SPEED_1)
+        TickTimeEvenRow = effect.m_value;
+    else
+        TickTimeOddRow = effect.m_value;
+}
 
-			//Delay 1 tick
-			esf->WaitCounter += 1;
+void DMFConverter::OnVolumeSlide(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channel& channel = Channels[chan];
 
-			//Set channel volume history
-			channel.LastVolume = channel.m_effectVolSlide.CurrVol;
+	int upSlide = (effect.m_value & 0xF0) >> 4;
+	int downSlide = -(effect.m_value & 0x0F);
+	channel.m_effectVolSlide.VolSlideValue = upSlide + downSlide;
+	if(channel.m_effectVolSlide.VolSlideValue == 0)
+		channel.m_effectVolSlide.VolSlide = EFFECT_OFF; //A00 (or equal halves) stops the slide
+	else
+		channel.m_effectVolSlide.VolSlide = (channel.m_effectVolSlide.VolSlideValue > 0) ? EFFECT_UP : EFFECT_DOWN;
+	channel.m_effectVolSlide.CurrVol = channel.LastVolume << 16;
+}
 
-			//If hit the volume limits, finished
-			if(channel.m_effectVolSlide.CurrVol == 0 || channel.m_effectVolSlide.CurrVol == 0x7f)
-			{
-				channel.m_effectVolSlide.VolSlide = EFFECT_OFF;
-			}
-		}
+void DMFConverter::OnVibrato(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channel& channel = Channels[chan];
 
-		//Decrease existing tick count
-		esf->WaitCounter -= i;
-	}
+	//Restarts from the middle of the LFO unless already running
+	if(channel.m_effectVibrato.Vibrato == EFFECT_OFF)
+		channel.m_effectVibrato.VibratoOffset = 0;
 
-    //Process new effects
-    for(EffectCounter=0;EffectCounter<Channels[chan].EffectCount;EffectCounter++)
-    {
-		EffectType = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectType;
-		EffectParam = m_dmfFile.m_channels[chan].m_patternPages[CurrPattern].m_notes[CurrRow].m_effects[EffectCounter].m_effectValue;
-        //fprintf(stdout, "%02x %02x, ",(int)EffectType,(int)EffectParam);
-        switch(EffectType)
-        {
-            /* Normal effects */
-		case EFFECT_TYPE_ARPEGGIO: // Arpeggio
-            if(EffectParam != 0)
-            {
-                Channels[chan].m_effectArpeggio.Arp = EFFECT_NORMAL;
-                uint8_t ArpOct;
-                uint8_t ArpNote;
-
-                /* do first freq */
-                ArpOct = Channels[chan].Octave;
-                ArpNote = Channels[chan].Note + (EffectParam & 0xf0 >> 4);
-                while(ArpNote > 12)
-                {
-                    ArpOct++;
-                    ArpNote-=12;
-                }
+	channel.m_effectVibrato.VibratoSpeed = effect.m_value >> 4;
+	channel.m_effectVibrato.VibratoDepth = effect.m_value & 0x0f;
+	channel.m_effectVibrato.Vibrato = (effect.m_value & 0x0f) ? EFFECT_NORMAL : EFFECT_OFF;
+}
 
-                /* PSG */
-                if(Channels[chan].Type == CHANNEL_TYPE_PSG)
-					Channels[chan].m_effectArpeggio.Arp1 = PSGFreqs[ArpNote][ArpOct - 2];
-                else
-					Channels[chan].m_effectArpeggio.Arp1 = (Channels[chan].Octave << 11) | FMFreqs[Channels[chan].Note];
+void DMFConverter::OnVibratoMode(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channels[chan].m_effectVibrato.VibratoMode = effect.m_value <= 2 ? effect.m_value : 0;
+}
 
-				Channels[chan].m_effectArpeggio.Arp2 = 0;
+void DMFConverter::OnFineVibratoDepth(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channels[chan].m_effectVibrato.VibratoFineDepth = effect.m_value & 0x0f;
+}
 
-                /* do second freq */
-                if((EffectParam & 0x0f) > 0)
-                {
-                    ArpOct = Channels[chan].Octave;
-                    ArpNote = Channels[chan].Note + (EffectParam & 0xf0 >> 4);
-                    while(ArpNote > 12)
-                    {
-                        ArpOct++;
-                        ArpNote-=12;
-                    }
+void DMFConverter::OnTremolo(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channel& channel = Channels[chan];
 
-                    /* PSG */
-                    if(Channels[chan].Type == CHANNEL_TYPE_PSG)
-						Channels[chan].m_effectArpeggio.Arp2 = PSGFreqs[ArpNote][ArpOct - 2];
-                    else
-						Channels[chan].m_effectArpeggio.Arp2 = (Channels[chan].Octave << 11) | FMFreqs[Channels[chan].Note];
-                }
+	if(channel.m_effectTremolo.Tremolo == EFFECT_OFF)
+		channel.m_effectTremolo.TremoloOffset = 0;
 
-            }
-            else
-            {
-				Channels[chan].m_effectArpeggio.Arp = EFFECT_OFF;
-            }
-            break;
-		case EFFECT_TYPE_PORTMENTO_UP: // Portamento up
-		case EFFECT_TYPE_PORTMENTO_DOWN: // Portamento down
-			//TODO: Fix for PSG
-			if(chan < CHANNEL_PSG1)
-			{
-				if(EffectParam == 0)
-				{
-					channel.m_effectPortmento.Porta = EFFECT_OFF;
-					channel.m_effectPortmento.Stage = EFFECT_STAGE_OFF;
-				}
-				else
-				{
-					channel.m_effectPortmento.NoteOnthisTick = (channel.Note != 0 || channel.Octave != 0);
+	channel.m_effectTremolo.TremoloSpeed = effect.m_value >> 4;
+	channel.m_effectTremolo.TremoloDepth = effect.m_value & 0x0f;
+	channel.m_effectTremolo.Tremolo = (effect.m_value & 0x0f) ? EFFECT_NORMAL : EFFECT_OFF;
+}
 
-					//If note on this tick or effect was off, start from last note/octave
-					if(channel.m_effectPortmento.NoteOnthisTick || channel.m_effectPortmento.Porta == EFFECT_OFF)
-					{
-						channel.m_effectPortmento.Semitone = FMFreqs[channel.LastNote];
-						channel.m_effectPortmento.Octave = channel.LastOctave;
-						channel.m_effectPortmento.Stage = EFFECT_STAGE_INITIALISE;
-					}
+void DMFConverter::OnNoteSlide(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channel& channel = Channels[chan];
 
-					channel.m_effectPortmento.Porta = EffectType == 0x01 ? EFFECT_UP : EFFECT_DOWN;
-					channel.m_effectPortmento.PortaSpeed = EffectParam;
-				}
-			}
-            break;
-		case EFFECT_TYPE_PORTMENTO_TO_NOTE: // Tone portamento
-			//channel.m_effectPortaNote.PortaNote = EFFECT_UP;
-			//channel.m_effectPortaNote.PortaNoteSpeed = EffectParam;
-			//channel.m_effectPortaNote.PortaNoteCurrentNote = Channels[chan].Note;
-			//channel.m_effectPortaNote.PortaNoteCurrentOctave = Channels[chan].Octave;
-			//channel.m_effectPortaNote.PortaNoteTargetNote = nextNote;
-			//channel.m_effectPortaNote.PortaNoteTargetOctave = nextOctave;
-            break;
-		case EFFECT_TYPE_PAN: // Set panning
-            if(Channels[chan].Type == CHANNEL_TYPE_FM || Channels[chan].Type == CHANNEL_TYPE_FM6)
-                esf->SetParams(Channels[chan].ESFId,(EffectParam & 0x10)<<3 | (EffectParam & 0x01)<<6);
-            break;
-		case EFFECT_TYPE_SET_SPEED_1: // Set speed 1
-            TickTimeEvenRow = EffectParam;
-            break;
-		case EFFECT_TYPE_SET_SPEED_2: // Set speed 2
-            TickTimeOddRow = EffectParam;
-            break;
-		case EFFECT_TYPE_VOLUME_SLIDE: // Volume slide
-		{
-			int upSlide = (EffectParam & 0xF0) >> 4;
-			int downSlide = -(EffectParam & 0x0F);
-			channel.m_effectVolSlide.VolSlideValue = upSlide + downSlide;
-			channel.m_effectVolSlide.VolSlide = (channel.m_effectVolSlide.VolSlideValue > 0) ? EFFECT_UP : EFFECT_DOWN;
-			channel.m_effectVolSlide.CurrVol = channel.LastVolume;
-			break;
-		}
-		case EFFECT_TYPE_JUMP: // Position jump
-            if(LoopFound == true && EffectParam <= CurrPattern && LoopFlag == false)
-                LoopFlag = true;
-            break;
-		case EFFECT_TYPE_BREAK: // Pattern break
-            SkipPattern = true;
-            if(CurrPattern != TotalPatterns)
-                NextPattern = CurrPattern+1;
-            else // should actually be the same as loop
-                NextPattern = 0;
-            NextRow = EffectParam;
-            break;
-            /* Unknown/unsupported effects */
-        default:
-            break;
-        }
-    }
+	channel.m_effectNoteSlide.NoteSlideSpeed = effect.m_value >> 4;
+	channel.m_effectNoteSlide.NoteSlideFinal = effect.m_value & 0x0f;
 
-    return 0;
+	if(channel.m_effectNoteSlide.NoteSlideFinal == 0)
+	{
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_OFF;
+		return;
+	}
+
+	int32_t distance = channel.m_effectNoteSlide.NoteSlideFinal << 16;
+	if(effect.m_type == EFFECT_TYPE_NOTE_SLIDE_UP)
+	{
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_UP;
+		channel.m_effectNoteSlide.NoteSlideTarget = Clamp(channel.Pitch + distance, 0, sMaxPitch);
+	}
+	else
+	{
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_DOWN;
+		channel.m_effectNoteSlide.NoteSlideTarget = Clamp(channel.Pitch - distance, 0, sMaxPitch);
+	}
+}
+
+void DMFConverter::OnRetrigger(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+	Channels[chan].m_effectRetrigger.RetrigSpeed = effect.m_value;
+	Channels[chan].m_effectRetrigger.Retrig = effect.m_value ? EFFECT_NORMAL : EFFECT_OFF;
 }
 
-EffectStage DMFConverter::GetActiveEffectStage(uint8_t chan)
+void DMFConverter::OnNoteCut(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
 {
-	//TODO: Other effects
-	return Channels[chan].m_effectPortmento.Porta == EFFECT_OFF ? EFFECT_STAGE_OFF : Channels[chan].m_effectPortmento.Stage;
+	Channels[chan].m_effectNoteCut.NoteCut = EFFECT_NORMAL;
+	Channels[chan].m_effectNoteCut.NoteCutOffset = effect.m_value;
 }
 
-int DMFConverter::ProcessActiveEffects(uint8_t chan)
+void DMFConverter::OnJump(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    if(LoopFound == true && effect.m_value <= CurrPattern && LoopFlag == false)
+        LoopFlag = true;
+}
+
+void DMFConverter::OnBreak(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern)
+{
+    SkipPattern = true;
+    if(CurrPattern != TotalPatterns)
+        NextPattern = CurrPattern+1;
+    else // should actually be the same as loop
+        NextPattern = 0;
+    NextRow = effect.m_value;
+}
+
+/** @brief Runs one tick of the channel's active effects and writes the frequency and volume they
+    add up to. Returns the number of effects processed, writes count as well so a note is put
+    back once its effects stop. **/
+int DMFConverter::ProcessActiveEffects(uint8_t chan, uint8_t tick)
 {
 	Channel& channel = Channels[chan];
 
+	TickOutput output = { 0, 0 };
 	int numEffectsProcess = 0;
 
-	//Process active effects
-	if(channel.m_effectPortmento.Porta != EFFECT_OFF)
+	for(int i = 0; i < sNumTickEffects; i++)
+	{
+		TickEffectFunc process = sTickEffects[i];
+		numEffectsProcess += (this->*process)(chan, tick, output);
+	}
+
+	if(channel.EffectFreq)
 	{
-		if(channel.m_effectPortmento.NoteOnthisTick)
+		uint16_t freq = GetPitchFrequency(chan, channel.Pitch + output.m_pitch);
+		if(freq != channel.EffectFreq)
 		{
-			//Had note on this row, skip
-			channel.m_effectPortmento.NoteOnthisTick = false;
+			esf->SetFrequency(channel.ESFId, freq);
+			channel.EffectFreq = freq;
+			numEffectsProcess++;
 		}
-		else
+	}
+
+	uint8_t volume = channel.LastVolume;
+	if(output.m_volume)
+		volume = Clamp(channel.LastVolume + (output.m_volume >> 16), 0, (int)GetMaxVolume(chan));
+
+	if(volume != channel.EffectVolume)
+	{
+		esf->SetVolume(channel.ESFId, volume);
+		channel.EffectVolume = volume;
+		numEffectsProcess++;
+	}
+
+	return numEffectsProcess;
+}
+
+int DMFConverter::ProcessRetrigger(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectRetrigger.Retrig == EFFECT_OFF)
+		return 0;
+
+	if(tick > 0 && tick % channel.m_effectRetrigger.RetrigSpeed == 0 && channel.LastNote != 0)
+	{
+		channel.Note = channel.LastNote;
+		channel.Octave = channel.LastOctave;
+		if(channel.Note == 12)
 		{
-			//Increment/decrement frequency
-			if(channel.m_effectPortmento.Porta == EFFECT_UP)
-			{
-				channel.m_effectPortmento.Semitone += channel.m_effectPortmento.PortaSpeed;
+			channel.Octave++;
+			channel.Note = 0;
+		}
+
+		StartNote(chan);
+	}
+
+	return 1;
+}
+
+int DMFConverter::ProcessNoteCut(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectNoteCut.NoteCut == EFFECT_OFF)
+		return 0;
+
+	if(tick == channel.m_effectNoteCut.NoteCutOffset)
+	{
+		esf->NoteOff(channel.ESFId);
+		channel.EffectFreq = 0;
+		channel.m_effectNoteCut.NoteCut = EFFECT_OFF;
+	}
+
+	return 1;
+}
+
+int DMFConverter::ProcessPortamento(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectPortmento.Porta == EFFECT_OFF || !channel.EffectFreq)
+		return 0;
+
+	//A new note plays unbent on its first tick
+	if(tick == 0 && channel.NoteOnThisRow)
+		return 1;
+
+	//Speed is in frequency register units, so the pitch change depends on the frequency
+	uint16_t freq = GetPitchFrequency(chan, channel.Pitch);
+	if(Channels[chan].Type != CHANNEL_TYPE_PSG)
+		freq &= 0x7ff;
+
+	int32_t delta = (int32_t)((int64_t)channel.m_effectPortmento.PortaSpeed * sSemitonesPerRatio / (freq ? freq : 1));
+	if(channel.m_effectPortmento.Porta == EFFECT_DOWN)
+		delta = -delta;
+
+	//Stop at the ends of the frequency range
+	channel.Pitch = Clamp(channel.Pitch + delta, 0, sMaxPitch);
+	if(channel.Pitch == 0 || channel.Pitch == sMaxPitch)
+		channel.m_effectPortmento.Porta = EFFECT_OFF;
+
+	return 1;
+}
+
+int DMFConverter::ProcessNoteSlide(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectNoteSlide.NoteSlide == EFFECT_OFF || !channel.EffectFreq)
+		return 0;
+
+	if(tick == 0 && channel.NoteOnThisRow)
+		return 1;
+
+	//Speed x moves (2x + 1) / 32 semitones per tick
+	int32_t step = (channel.m_effectNoteSlide.NoteSlideSpeed * 2 + 1) << 11;
+	int32_t target = channel.m_effectNoteSlide.NoteSlideTarget;
+
+	if(channel.m_effectNoteSlide.NoteSlide == EFFECT_UP)
+		channel.Pitch = channel.Pitch + step < target ? channel.Pitch + step : target;
+	else
+		channel.Pitch = channel.Pitch - step > target ? channel.Pitch - step : target;
+
+	if(channel.Pitch == target)
+		channel.m_effectNoteSlide.NoteSlide = EFFECT_OFF;
+
+	return 1;
+}
+
+int DMFConverter::ProcessArpeggio(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectArpeggio.Arp == EFFECT_OFF)
+		return 0;
+
+	//Note, first then second offset, each held for the module's arpeggio tick speed
+	uint8_t speed = ArpTickSpeed ? ArpTickSpeed : 1;
+	uint8_t step = channel.m_effectArpeggio.ArpCounter / speed;
+
+	if(step == 1)
+		output.m_pitch += channel.m_effectArpeggio.Arp1 << 16;
+	else if(step == 2)
+		output.m_pitch += channel.m_effectArpeggio.Arp2 << 16;
+
+	channel.m_effectArpeggio.ArpCounter = (channel.m_effectArpeggio.ArpCounter + 1) % (speed * 3);
+	return 1;
+}
+
+int DMFConverter::ProcessVibrato(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectVibrato.Vibrato == EFFECT_OFF)
+		return 0;
+
+	int32_t sine = sLFOTable.m_sine[channel.m_effectVibrato.VibratoOffset];
+	if(channel.m_effectVibrato.VibratoMode == 1)
+		sine = sine < 0 ? -sine : sine;
+	else if(channel.m_effectVibrato.VibratoMode == 2)
+		sine = sine > 0 ? -sine : sine;
+
+	//Full depth and fine depth swing by 15/16 of a semitone
+	output.m_pitch += (int32_t)((int64_t)sine * channel.m_effectVibrato.VibratoDepth * channel.m_effectVibrato.VibratoFineDepth / (16 * 15));
+
+	channel.m_effectVibrato.VibratoOffset = (channel.m_effectVibrato.VibratoOffset + channel.m_effectVibrato.VibratoSpeed) % LFOTable::sNumSteps;
+	return 1;
+}
+
+int DMFConverter::ProcessVolumeSlide(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
+
+	if(channel.m_effectVolSlide.VolSlide == EFFECT_OFF)
+		return 0;
+
+	int32_t maxVolume = GetMaxVolume(chan) << 16;
+	channel.m_effectVolSlide.CurrVol = Clamp(channel.m_effectVolSlide.CurrVol + channel.m_effectVolSlide.VolSlideValue * 0x10000, 0, maxVolume);
+
+	//Set channel volume history
+	channel.LastVolume = channel.m_effectVolSlide.CurrVol >> 16;
+
+	//If hit the volume limits, finished
+	if(channel.m_effectVolSlide.CurrVol == 0 || channel.m_effectVolSlide.CurrVol == maxVolume)
+		channel.m_effectVolSlide.VolSlide = EFFECT_OFF;
+
+	return 1;
+}
+
+int DMFConverter::ProcessTremolo(uint8_t chan, uint8_t tick, TickOutput& output)
+{
+	Channel& channel = Channels[chan];
 
-				//Clamp to max octave+freq
-				if(channel.m_effectPortmento.Octave == MaxOctave && channel.m_effectPortmento.Semitone > FMFreqs[MaxFMFreqs - 1])
-				{
-					channel.m_effectPortmento.Semitone = FMFreqs[MaxFMFreqs - 1];
-					channel.m_effectPortmento.Porta = EFFECT_OFF;
-				}
-			}
-			else if(channel.m_effectPortmento.Porta == EFFECT_DOWN)
-			{
-				channel.m_effectPortmento.Semitone -= channel.m_effectPortmento.PortaSpeed;
+	if(channel.m_effectTremolo.Tremolo == EFFECT_OFF)
+		return 0;
 
-				//Clamp to min octave+freq
-				if(channel.m_effectPortmento.Octave == 0 && channel.m_effectPortmento.Semitone < FMFreqs[0])
-				{
-					channel.m_effectPortmento.Semitone = FMFreqs[0];
-					channel.m_effectPortmento.Porta = EFFECT_OFF;
-				}
-			}
+	//Tremolo only lowers the volume, full depth halves it
+	int32_t level = (sLFOTable.m_sine[channel.m_effectTremolo.TremoloOffset] + 0x10000) / 2;
+	output.m_volume -= (int32_t)((int64_t)level * channel.m_effectTremolo.TremoloDepth * GetMaxVolume(chan) / (15 * 2));
 
-			//Wrap around octave
-			if(channel.m_effectPortmento.Semitone < FMFreqs[0])
-			{
-				channel.m_effectPortmento.Semitone = FMFreqs[MaxFMFreqs - 1];
-				channel.m_effectPortmento.Octave--;
-			}
+	channel.m_effectTremolo.TremoloOffset = (channel.m_effectTremolo.TremoloOffset + channel.m_effectTremolo.TremoloSpeed) % LFOTable::sNumSteps;
+	return 1;
+}
 
-			if(channel.m_effectPortmento.Semitone > FMFreqs[MaxFMFreqs - 1])
-			{
-				channel.m_effectPortmento.Semitone = FMFreqs[0];
-				channel.m_effectPortmento.Octave++;
-			}
+/** @brief Plays the row's note and restarts the pitch effects from it **/
+void DMFConverter::StartNote(uint8_t chan)
+{
+	Channel& channel = Channels[chan];
 
-			//Set frequency
-			channel.Octave = channel.m_effectPortmento.Octave;
-			SetFrequency(chan, channel.m_effectPortmento.Semitone, false);
-		}
+	//NoteOn() changes the octave of PSG channels
+	channel.Pitch = (channel.Octave * 12 + channel.Note) << 16;
+	channel.NoteOnThisRow = true;
+	channel.m_effectArpeggio.ArpCounter = 0;
 
-		//Continue until next note off
-		numEffectsProcess++;
-		channel.m_effectPortmento.Stage = EFFECT_STAGE_CONTINUE;
-	}
+	NoteOn(chan);
 
-	return numEffectsProcess;
+	channel.EffectFreq = CanBendPitch(chan) ? GetPitchFrequency(chan, channel.Pitch) : 0;
 }
 
 void DMFConverter::NoteOn(uint8_t chan)
@@ -913,7 +1503,7 @@ void DMFConverter::NoteOn(uint8_t chan)
             Channels[chan].Octave--;
 
             /* Get the frequency value */
-            Channels[chan-1].ToneFreq = PSGFreqs[Channels[chan].Note][Channels[chan].Octave];
+            Channels[chan-1].ToneFreq = Frequencies->GetPSG(Channels[chan].Note, Channels[chan].Octave);
 
             /* Only update frequency if it's not the same as the last */
             if(Channels[chan-1].LastFreq != Channels[chan-1].ToneFreq)
@@ -954,13 +1544,13 @@ void DMFConverter::NoteOn(uint8_t chan)
         /* Is this an FM channel? */
         if(Channels[chan].Type == CHANNEL_TYPE_FM || (Channels[chan].Type == CHANNEL_TYPE_FM6 && DACEnabled == false))
         {
-            Channels[chan].ToneFreq = (Channels[chan].Octave<<11)|FMFreqs[Channels[chan].Note];
+            Channels[chan].ToneFreq = (Channels[chan].Octave<<11)|Frequencies->GetFM(Channels[chan].Note);
         }
         /* PSG */
         else if(Channels[chan].Type == CHANNEL_TYPE_PSG)
         {
             Channels[chan].Octave--;
-            Channels[chan].ToneFreq = PSGFreqs[Channels[chan].Note][Channels[chan].Octave];
+            Channels[chan].ToneFreq = Frequencies->GetPSG(Channels[chan].Note, Channels[chan].Octave);
         }
 
         /* Reset last tone / new tone freqs */
@@ -979,6 +1569,18 @@ void DMFConverter::NoteOn(uint8_t chan)
 
 			//Samples at end of instrument table
 			int pcmInstrIdx = TotalInstruments + InstrumentOffset + sampleIdx;
+			if(Pool)
+			{
+				//Pooled indices are shared with other tracks, one past this track's samples may be
+				//anything, so a missing sample plays nothing
+				if(sampleIdx >= TotalSamples)
+				{
+					if(VerboseLog)
+						fprintf(stderr, "No sample %i for the DAC note in pattern %i, row %i, skipped\n", sampleIdx, (int)CurrPattern, (int)CurrRow);
+					return;
+				}
+				pcmInstrIdx = PoolMap[TotalInstruments + sampleIdx];
+			}
 
 			//PCM note on
 			esf->NoteOn(ESF_DAC, pcmInstrIdx);
@@ -991,74 +1593,121 @@ void DMFConverter::NoteOn(uint8_t chan)
     return;
 }
 
-void DMFConverter::SetFrequency(uint8_t chan, uint32_t FMSemitone, bool processDelay)
+/** @brief Returns true if effects can change the channel's frequency. The noise channel and PSG3
+    while it clocks the noise are left alone, as is FM6 while it plays samples. **/
+bool DMFConverter::CanBendPitch(uint8_t chan)
 {
-    /* Is this the PSG noise channel? */
-    if (Channels[chan].Type == CHANNEL_TYPE_PSG4)
-    {
-        uint8_t NoiseMode = 0;
+	switch(Channels[chan].Type)
+	{
+	case CHANNEL_TYPE_FM:
+		return true;
+	case CHANNEL_TYPE_FM6:
+		return !DACEnabled;
+	case CHANNEL_TYPE_PSG:
+		return !(Channels[chan].Id == CHANNEL_PSG3 && PSGNoiseFreq);
+	default:
+		return false;
+	}
+}
 
-        /* Is periodic noise active? */
-        if(PSGPeriodicNoise)
-            NoiseMode = 4;
+/** @brief Frequency register value for a 16.16 pitch in semitones above C-0. Between the table's
+    fine steps it is interpolated, so slow slides still move every tick. **/
+uint16_t DMFConverter::GetPitchFrequency(uint8_t chan, int32_t pitch)
+{
+	pitch = Clamp(pitch, 0, sMaxPitch);
 
-        /* Are we using the PSG3 frequency? */
-        if(PSGNoiseFreq)
-        {
-            // if C-8 change it to B-7
-            if(Channels[chan].Note == 0 && Channels[chan].Octave == 8)
-            {
-                Channels[chan].Octave--;
-                Channels[chan].Note = 11;
-            }
-            Channels[chan].Octave--;
+	int64_t fineStep = (int64_t)pitch * FrequencyTable::sFineSteps;
+	int octave = (int)(fineStep >> 16) / FrequencyTable::sNumSteps;
+	int step = (int)(fineStep >> 16) % FrequencyTable::sNumSteps;
+	int frac = (int)(fineStep & 0xffff);
 
-            /* Get the frequency value */
-            Channels[chan-1].ToneFreq = PSGFreqs[Channels[chan].Note][Channels[chan].Octave];
+	if(Channels[chan].Type == CHANNEL_TYPE_PSG)
+	{
+		//PSG octaves are one lower, as in NoteOn()
+		int from = Frequencies->GetPSG(0, octave - 1, step);
+		int to = step + 1 < FrequencyTable::sNumSteps ? Frequencies->GetPSG(0, octave - 1, step + 1) : Frequencies->GetPSG(0, octave, 0);
+		return from + ((to - from) * frac >> 16);
+	}
 
-            /* Only update frequency if it's not the same as the last */
-            if(Channels[chan-1].LastFreq != Channels[chan-1].ToneFreq)
-                esf->SetFrequency(Channels[chan-1].ESFId,Channels[chan-1].ToneFreq, processDelay);
+	int from = Frequencies->GetFM(0, step);
+	int to = step + 1 < FrequencyTable::sNumSteps ? Frequencies->GetFM(0, step + 1) : Frequencies->GetFM(0, 0) * 2;
+	return (octave << 11) | (from + ((to - from) * frac >> 16));
+}
 
-            Channels[chan-1].LastFreq = Channels[chan-1].ToneFreq;
+uint8_t DMFConverter::GetMaxVolume(uint8_t chan)
+{
+	return (Channels[chan].Type == CHANNEL_TYPE_PSG || Channels[chan].Type == CHANNEL_TYPE_PSG4) ? 0x0f : 0x7f;
+}
 
-            NoiseMode = NoiseMode + 3;
+/** @brief Writes an instrument or sample to disk, or keeps it in OutputFiles when set */
+void DMFConverter::WriteOutputFile(const char* filename, const uint8_t* fileData, size_t size)
+{
+	if(OutputFiles)
+	{
+		OutputFiles->push_back(OutputFile());
+		OutputFiles->back().m_name = filename;
+		OutputFiles->back().m_data.assign(fileData, fileData + size);
+		return;
+	}
 
-        }
-    }
+	if(FILE* file = fopen(filename, "wb"))
+	{
+		fwrite(fileData, size, 1, file);
+		fclose(file);
+	}
+}
 
-    /* Skip if this is the PSG3 channel and its frequency value is already used for the noise channel */
-	else if(!(Channels[chan].Id == CHANNEL_PSG3 && PSGNoiseFreq))
-    {
-        /* Calculate frequency */
-        Channels[chan].ToneFreq = 0;    // Reset if this is for a channel where this doesn't make much sense.
+/** @brief Looks up this track's instruments and samples in the pool, fills PoolMap and writes
+    the ones the pool hasn't seen under their new index. Returns true if the pool is full. **/
+bool DMFConverter::AddToPool(std::vector<OutputFile>& files)
+{
+	bool failed = false;
+	std::vector<uint8_t> isNew(files.size(), 0);
 
-        /* Is this an FM channel? */
-        if(Channels[chan].Type == CHANNEL_TYPE_FM || (Channels[chan].Type == CHANNEL_TYPE_FM6 && DACEnabled == false))
-        {
-			Channels[chan].ToneFreq = (Channels[chan].Octave << 11) | FMSemitone; // FMFreqs[Channels[chan].Note];
-        }
-        /* PSG */
-        else if(Channels[chan].Type == CHANNEL_TYPE_PSG)
-        {
-            Channels[chan].Octave--;
-            Channels[chan].ToneFreq = PSGFreqs[Channels[chan].Note][Channels[chan].Octave];
-        }
+	Pool->BeginTrack(TrackIndex);
+	for(size_t i = 0; i < files.size() && !failed; i++)
+	{
+		bool added = false;
+		failed = Pool->Add(files[i], PoolMap[i], added);
+		isNew[i] = added;
+	}
+	Pool->EndTrack(TrackIndex);
+	PoolTurnTaken = true;
+
+	if(failed)
+		return 1;
 
-		if(!(Channels[chan].Type == CHANNEL_TYPE_FM6 && DACEnabled == true))
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		if(isNew[i])
 		{
-			if(Channels[chan].LastFreq != Channels[chan].ToneFreq)
-			{
-				esf->SetFrequency(Channels[chan].ESFId, Channels[chan].ToneFreq, processDelay);
-			}
+			const std::string& name = files[i].m_name;
+
+			char filename[FILENAME_MAX] = { 0 };
+			snprintf(filename, FILENAME_MAX, "instr_%02x%s", (int)PoolMap[i], name.substr(name.rfind('.')).c_str());
+			WriteOutputFile(filename, files[i].m_data.empty() ? NULL : &files[i].m_data[0], files[i].m_data.size());
 		}
+	}
 
-        /* Reset last tone / new tone freqs */
-        Channels[chan].NoteFreq = Channels[chan].ToneFreq;
-        Channels[chan].LastFreq = 0;
-        Channels[chan].NewFreq = 0;
-    }
-    return;
+	return 0;
+}
+
+/** @brief Gives up this track's pool and offset turns if it never got as far as taking them, so
+    later tracks don't wait for it forever **/
+void DMFConverter::SkipTurns()
+{
+	if(Pool && !PoolTurnTaken)
+	{
+		Pool->BeginTrack(TrackIndex);
+		Pool->EndTrack(TrackIndex);
+		PoolTurnTaken = true;
+	}
+
+	if(Offsets && !OffsetTurnTaken)
+	{
+		Offsets->Skip(TrackIndex);
+		OffsetTurnTaken = true;
+	}
 }
 
 /** Extracts FM instrument data and stores as params for the EIF macro */
@@ -1080,236 +1729,644 @@ void DMFConverter::OutputInstrument(int instrumentIdx, const char* filename)
 			fprintf(stdout, "fb  = %d\n", (int)paramDataIn.fb);  //FB
 		}
 
-		for(int i = 0; i < DMFFile::sMaxOperators; i++)
-		{
-			DMFFile::Instrument::ParamDataFM::Operator& opData = paramDataIn.m_operators[i];
+		for(int i = 0; i < DMFFile::sMaxOperators; i++)
+		{
+			DMFFile::Instrument::ParamDataFM::Operator& opData = paramDataIn.m_operators[i];
+
+			int op = optable[i];
+
+			//Out of range detune from a damaged module counts as none
+			int detune = opData.dt >= 0 && opData.dt < (int)sizeof(dttable) ? dttable[opData.dt] : 0;
+
+			if(VerboseLog)
+			{
+				fprintf(stdout, "ar%d  = %d\n", op, (int)opData.ar);  //AR
+				fprintf(stdout, "dr%d  = %d\n", op, (int)opData.dr);  //DR
+				fprintf(stdout, "d2r%d  = %d\n", op, (int)opData.d2r); //D2R
+				fprintf(stdout, "rr%d  = %d\n", op, (int)opData.rr);  //RR
+				fprintf(stdout, "tl%d  = %d\n", op, (int)opData.tl); //TL
+				fprintf(stdout, "sl%d  = %d\n", op, (int)opData.sl); //SL
+				fprintf(stdout, "mul%d = %d\n", op, (int)opData.mul); //MULT
+				fprintf(stdout, "dt%d  = %d\n", op, detune); //DT
+				fprintf(stdout, "rs%d  = %d\n", op, (int)opData.rs); //RS
+				fprintf(stdout, "ssg%d = $%02x\n", op, (int)opData.ssg);//SSG-EG
+			}
+
+			// Detune = -3 to 3, bit 4 is primitive, inverted sign
+			uint8_t dt = 0;
+			if(detune < 0)
+			{
+				dt = (int)abs(detune) & 0x3;
+				dt |= 0x4;
+			}
+			else
+			{
+				dt = detune & 0x3;
+			}
+
+			//Fields are bytes from the module, shifted as unsigned
+			paramDataOut.mul[i] = (opData.mul | (dt << 4));
+			paramDataOut.tl[i] = opData.tl;
+			paramDataOut.ar_rs[i] = (opData.ar | ((uint8_t)opData.rs << 6));
+			paramDataOut.dr[i] = (opData.dr | ((uint8_t)opData.am << 7));
+			paramDataOut.sr[i] = opData.d2r;
+			paramDataOut.rr_sl[i] = (opData.rr | ((uint8_t)opData.sl << 4));
+			paramDataOut.ssg[i] = opData.ssg;
+		}
+
+		WriteOutputFile(filename, (const uint8_t*)&paramDataOut, sizeof(ESFFile::ParamDataFM));
+
+		if(VerboseLog)
+		{
+			fprintf(stdout, "\teif\n; end of FM instrument\n");
+		}
+	}
+	else
+	{
+		DMFFile::Instrument::ParamDataPSG& paramDataIn = m_dmfFile.m_instruments[instrumentIdx].m_paramsPSG;
+
+		//Create envelope data (no loop = end stream with mute loop (FE 0F FF))
+		const bool looped = paramDataIn.envelopeVolume.loopPosition != 255;
+		const int loopDataSize = looped ? 1 : 3;
+		const int streamEnd = paramDataIn.envelopeVolume.envelopeSize + (looped ? 1 : 0);
+		const int dataSize = streamEnd + loopDataSize;
+
+		Arena::Mark mark = m_arena.GetMark();
+		uint8_t* data = m_arena.Alloc<uint8_t>(dataSize);
+
+		int offset = 0;
+		int volumeIdx = 0;
+		while(offset < dataSize)
+		{
+			if(offset == streamEnd)
+			{
+				//End of data
+				if(loopDataSize == 1)
+				{
+					data[offset++] = 0xFF;
+				}
+				else
+				{
+					data[offset++] = 0xFE;
+					data[offset++] = 0x0F;
+					data[offset++] = 0xFF;
+				}
+			}
+			else if(offset == paramDataIn.envelopeVolume.loopPosition)
+			{
+				//Loop start
+				data[offset++] = 0xFE;
+			}
+			else
+			{
+				data[offset++] = 0xF - paramDataIn.envelopeVolume.GetValue(volumeIdx);
+				volumeIdx++;
+			}
+		}
+
+		WriteOutputFile(filename, data, dataSize);
+
+		m_arena.Rewind(mark);
+
+		if(VerboseLog)
+		{
+			fprintf(stdout, "\teif\n; end of PSG instrument\n");
+		}
+	}
+
+    return;
+}
+
+static const int sNumFIRTaps = 16;
+
+/** Outputs resampled at a time, the float buffers don't grow with the sample */
+static const uint32_t sSampleChunkSize = 4096;
+static const int sNumSampleRates = sizeof(DMFFile::sSampleRates) / sizeof(DMFFile::sSampleRates[0]);
+
+/** libsamplerate converter for each tier */
+static const int sConverters[SAMPLE_QUALITY_COUNT] =
+{
+	-1, SRC_SINC_BEST_QUALITY, SRC_SINC_MEDIUM_QUALITY, SRC_SINC_FASTEST, -1, SRC_LINEAR, SRC_ZERO_ORDER_HOLD,
+};
+
+/** @brief Returns true unless the sample is already 8-bit and close to sTargetSampleRate. Samples
+    with an unknown rate can't be resampled. **/
+static bool NeedsResampling(const DMFFile::Sample& sample)
+{
+	const int toleranceHz = 100;
+
+	if(sample.m_sampleRate == 0 || sample.m_sampleRate >= sNumSampleRates)
+		return false;
+
+	return sample.m_bitsPerSample != 8 || abs(DMFFile::sSampleRates[sample.m_sampleRate] - DMFFile::sTargetSampleRate) > toleranceHz;
+}
+
+/** @brief Returns the filter bank for a tier and DMF sample rate, or NULL if the tier isn't a
+    filter (linear and zero-order hold). There are only a few rates and one target rate, so each
+    bank is built the first time it's needed and shared by every sample after it. **/
+static const PolyphaseResampler* GetResampler(SampleQuality quality, int sampleRate)
+{
+	static std::mutex sMutex;
+	static PolyphaseResampler* sBanks[SAMPLE_QUALITY_COUNT][sNumSampleRates];
+
+	const float* table;
+	int tableHalfLen, tableIncrement;
+
+	bool isSinc = src_sinc_get_table(sConverters[quality], &table, &tableHalfLen, &tableIncrement) == 0;
+	if(quality != SAMPLE_QUALITY_FIR && !isSinc)
+		return NULL;
+
+	std::lock_guard<std::mutex> lock(sMutex);
+
+	PolyphaseResampler*& bank = sBanks[quality][sampleRate];
+	if(!bank)
+	{
+		int inputRate = DMFFile::sSampleRates[sampleRate];
+
+		if(isSinc)
+			bank = new PolyphaseResampler(inputRate, DMFFile::sTargetSampleRate, table, tableHalfLen, tableIncrement);
+		else
+			bank = new PolyphaseResampler(inputRate, DMFFile::sTargetSampleRate, sNumFIRTaps);
+	}
+
+	return bank;
+}
+
+/** @brief Converts count sample values from first on to floats in -1..1, with silence outside
+    the sample. 8-bit samples are unsigned, 16-bit ones signed. **/
+static void SampleToFloat(const DMFFile::Sample& sample, int64_t first, uint32_t count, float* output)
+{
+	int64_t start = std::min<int64_t>(std::max<int64_t>(first, 0), first + count);
+	int64_t end = std::max<int64_t>(std::min<int64_t>(first + count, sample.m_sampleSize), start);
+
+	std::fill(output, output + (start - first), 0.0f);
+	std::fill(output + (end - first), output + count, 0.0f);
+
+	const uint8_t* data = sample.m_sampleData + start * sizeof(uint16_t);
+	float* out = output + (start - first);
+	uint32_t numValues = end - start;
+	bool is8Bit = sample.m_bitsPerSample == 8;
+
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	//Eight little endian words at a time
+	const __m128 scale = _mm_set1_ps(is8Bit ? 1.0f / 128.0f : 1.0f / 32768.0f);
+	const __m128i lowByte = _mm_set1_epi16(0xFF);
+	const __m128i bias = _mm_set1_epi32(0x80);
+
+	for(; i + 8 <= numValues; i += 8)
+	{
+		__m128i words = _mm_loadu_si128((const __m128i*)(data + i * sizeof(uint16_t)));
+		__m128i lo, hi;
+
+		if(is8Bit)
+		{
+			words = _mm_and_si128(words, lowByte);
+			lo = _mm_sub_epi32(_mm_unpacklo_epi16(words, _mm_setzero_si128()), bias);
+			hi = _mm_sub_epi32(_mm_unpackhi_epi16(words, _mm_setzero_si128()), bias);
+		}
+		else
+		{
+			//Sign extend
+			lo = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+			hi = _mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16);
+		}
+
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+#endif
+
+	for(; i < numValues; i++)
+	{
+		uint16_t value = Stream::ReadU16(data + i * sizeof(uint16_t));
+
+		if(is8Bit)
+			out[i] = (float)((int)(value & 0xFF) - 0x80) * (1.0f / 128.0f);
+		else
+			out[i] = (float)(int16_t)value * (1.0f / 32768.0f);
+	}
+}
+
+/** @brief Dithers, rounds and clamps count floats to EWF bytes, keeping 0xFF free for the end
+    marker. The triangular dither comes from four xorshift generators, one per lane, so the SSE2
+    and plain builds give the same bytes. **/
+static void FloatToEWF(const float* input, uint32_t count, uint32_t dither[4], uint8_t* output)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i lowHalf = _mm_set1_epi32(0xFFFF);
+	const __m128 ditherScale = _mm_set1_ps(1.0f / 65536.0f);
+	const __m128 gain = _mm_set1_ps(128.0f);
+	const __m128 offset = _mm_set1_ps(128.5f);
+	const __m128 minValue = _mm_setzero_ps();
+	const __m128 maxValue = _mm_set1_ps(254.0f);
+
+	__m128i state = _mm_loadu_si128((const __m128i*)dither);
+
+	for(; i + 4 <= count; i += 4)
+	{
+		state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+		state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+		state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+
+		//Difference of two uniform halves
+		__m128i noise = _mm_sub_epi32(_mm_and_si128(state, lowHalf), _mm_srli_epi32(state, 16));
+
+		__m128 value = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(input + i), gain), offset);
+		value = _mm_add_ps(value, _mm_mul_ps(_mm_cvtepi32_ps(noise), ditherScale));
+		value = _mm_min_ps(_mm_max_ps(value, minValue), maxValue);
+
+		__m128i bytes = _mm_cvttps_epi32(value);
+		bytes = _mm_packs_epi32(bytes, bytes);
+		bytes = _mm_packus_epi16(bytes, bytes);
+
+		uint32_t packed = _mm_cvtsi128_si32(bytes);
+		memcpy(output + i, &packed, sizeof(packed));
+	}
+
+	_mm_storeu_si128((__m128i*)dither, state);
+#endif
+
+	for(; i < count; i++)
+	{
+		uint32_t& state = dither[i & 3];
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+
+		float noise = (float)((int32_t)(state & 0xFFFF) - (int32_t)(state >> 16)) * (1.0f / 65536.0f);
+		float value = input[i] * 128.0f + 128.5f + noise;
+
+		output[i] = (uint8_t)Clamp(value, 0.0f, 254.0f);
+	}
+}
+
+/** @brief Converts a sample to EWF, 8-bit unsigned with 0xFF only as the end marker. Unless quality
+    is SAMPLE_QUALITY_NONE or the sample already is close to that, it is also resampled to
+    sTargetSampleRate, sSampleChunkSize outputs at a time through buffers. Only reads the module, so
+    several samples can be converted at once. Returns true if resampling failed. **/
+bool DMFConverter::ConvertSample(int sampleIdx, SampleQuality quality, SampleBuffers& buffers, std::vector<uint8_t>& ewf) const
+{
+	const DMFFile::Sample& sample = m_dmfFile.m_samples[sampleIdx];
+
+	//If correct format, skip conversion
+	if(quality == SAMPLE_QUALITY_NONE || !NeedsResampling(sample))
+	{
+		uint32_t outputSize = sample.m_sampleSize + 1;
+
+		ewf.resize(outputSize);
 
-			int op = optable[i];
+		for(int i = 0; i < outputSize - 1; i++)
+		{
+			ewf[i] = ((uint8_t)sample.GetValue(i) & 0xFF);
 
-			if(VerboseLog)
+			//Nudge 0xFF bytes to 0xFE
+			if(ewf[i] == 0xFF)
 			{
-				fprintf(stdout, "ar%d  = %d\n", op, (int)opData.ar);  //AR
-				fprintf(stdout, "dr%d  = %d\n", op, (int)opData.dr);  //DR
-				fprintf(stdout, "d2r%d  = %d\n", op, (int)opData.d2r); //D2R
-				fprintf(stdout, "rr%d  = %d\n", op, (int)opData.rr);  //RR
-				fprintf(stdout, "tl%d  = %d\n", op, (int)opData.tl); //TL
-				fprintf(stdout, "sl%d  = %d\n", op, (int)opData.sl); //SL
-				fprintf(stdout, "mul%d = %d\n", op, (int)opData.mul); //MULT
-				fprintf(stdout, "dt%d  = %d\n", op, dttable[opData.dt]); //DT
-				fprintf(stdout, "rs%d  = %d\n", op, (int)opData.rs); //RS
-				fprintf(stdout, "ssg%d = $%02x\n", op, (int)opData.ssg);//SSG-EG
+				ewf[i] = 0xFE;
 			}
+		}
 
-			// Detune = -3 to 3, bit 4 is primitive, inverted sign
-			uint8_t dt = 0;
-			if(dttable[opData.dt] < 0)
-			{
-				dt = (int)abs(dttable[opData.dt]) & 0x3;
-				dt |= 0x4;
-			}
-			else
-			{
-				dt = dttable[opData.dt] & 0x3;
-			}
+		//End of data
+		ewf[outputSize - 1] = 0xFF;
+		return 0;
+	}
 
-			paramDataOut.mul[i] = (opData.mul | (dt << 4));
-			paramDataOut.tl[i] = opData.tl;
-			paramDataOut.ar_rs[i] = (opData.ar | (opData.rs << 6));
-			paramDataOut.dr[i] = (opData.dr | (opData.am << 7));
-			paramDataOut.sr[i] = opData.d2r;
-			paramDataOut.rr_sl[i] = (opData.rr | (opData.sl << 4));
-			paramDataOut.ssg[i] = opData.ssg;
-		}
+	//Resampled before, by this module or another one
+	uint64_t cacheKey = 0;
+	if(SampleCache)
+	{
+		cacheKey = SampleCache->GetSampleKey(sample, quality);
+		if(SampleCache->LoadSample(cacheKey, ewf) == 0)
+			return 0;
+	}
 
-		if(FILE* file = fopen(filename, "wb"))
-		{
-			fwrite((char*)&paramDataOut, sizeof(ESFFile::ParamDataFM), 1, file);
-			fclose(file);
-		}
+	//Same seed for every sample, identical samples give identical files
+	uint32_t dither[4] = { 0x2545F491, 0x9E3779B9, 0x6C8E9CF5, 0xB5297A4D };
 
-		if(VerboseLog)
+	const PolyphaseResampler* resampler = GetResampler(quality, sample.m_sampleRate);
+	if(resampler)
+	{
+		uint32_t numOutput = resampler->GetOutputSize(sample.m_sampleSize);
+		ewf.resize(numOutput + 1);
+
+		buffers.m_input.resize(resampler->GetMaxInputSpan(sSampleChunkSize));
+		buffers.m_output.resize(sSampleChunkSize);
+
+		for(uint32_t position = 0; position < numOutput; position += sSampleChunkSize)
 		{
-			fprintf(stdout, "\teif\n; end of FM instrument\n");
+			uint32_t count = std::min(sSampleChunkSize, numOutput - position);
+
+			SampleToFloat(sample, resampler->GetFirstInput(position), resampler->GetInputSpan(position, count), &buffers.m_input[0]);
+			resampler->Process(&buffers.m_input[0], position, count, &buffers.m_output[0]);
+			FloatToEWF(&buffers.m_output[0], count, dither, &ewf[position]);
 		}
 	}
 	else
 	{
-		DMFFile::Instrument::ParamDataPSG& paramDataIn = m_dmfFile.m_instruments[instrumentIdx].m_paramsPSG;
+		//Linear and zero-order hold, streamed through libsamplerate
+		int error = 0;
+		SRC_STATE* state = src_new(sConverters[quality], 1, &error);
+		if(!state)
+			return 1;
 
-		//Create envelope data (no loop = end stream with mute loop (FE 0F EE))
-		const int loopDataSize = (paramDataIn.envelopeVolume.loopPosition == 255) ? 3 : 1;
-		const int dataSize = paramDataIn.envelopeVolume.envelopeSize + loopDataSize + 1;
-		const int streamEnd = dataSize - loopDataSize - 1;
+		buffers.m_input.resize(sSampleChunkSize);
+		buffers.m_output.resize(sSampleChunkSize);
 
-		uint8_t* data = new uint8_t[dataSize];
+		SRC_DATA srcData;
+		srcData.src_ratio = (double)DMFFile::sTargetSampleRate / (double)DMFFile::sSampleRates[sample.m_sampleRate];
 
-		int offset = 0;
-		int volumeIdx = 0;
-		while(offset < dataSize)
+		ewf.clear();
+		ewf.reserve(sample.m_sampleSize * srcData.src_ratio + 2);
+
+		uint32_t position = 0;
+		for(;;)
 		{
-			if(offset == streamEnd)
-			{
-				//End of data
-				if(loopDataSize == 1)
-				{
-					data[offset++] = 0xFF;
-				}
-				else
-				{
-					data[offset++] = 0xFE;
-					data[offset++] = 0x0F;
-					data[offset++] = 0xFF;
-				}
-			}
-			else if(offset == paramDataIn.envelopeVolume.loopPosition)
-			{
-				//Loop start
-				data[offset++] = 0xFE;
-			}
-			else
+			uint32_t count = std::min(sSampleChunkSize, sample.m_sampleSize - position);
+			SampleToFloat(sample, position, count, &buffers.m_input[0]);
+
+			srcData.data_in = &buffers.m_input[0];
+			srcData.input_frames = count;
+			srcData.data_out = &buffers.m_output[0];
+			srcData.output_frames = sSampleChunkSize;
+			srcData.end_of_input = position + count == sample.m_sampleSize;
+
+			if(src_process(state, &srcData))
 			{
-				data[offset++] = 0xF - paramDataIn.envelopeVolume.envelopeData[volumeIdx];
-				volumeIdx++;
+				src_delete(state);
+				return 1;
 			}
-		}
 
-		if(FILE* file = fopen(filename, "w"))
-		{
-			fwrite((char*)data, dataSize, 1, file);
-			fclose(file);
-		}
+			position += srcData.input_frames_used;
 
-		if(VerboseLog)
-		{
-			fprintf(stdout, "\teif\n; end of PSG instrument\n");
+			size_t size = ewf.size();
+			ewf.resize(size + srcData.output_frames_gen);
+			FloatToEWF(&buffers.m_output[0], srcData.output_frames_gen, dither, ewf.data() + size);
+
+			//Finished once the converter has nothing left after the last input
+			if(srcData.end_of_input && srcData.output_frames_gen == 0)
+				break;
 		}
+
+		src_delete(state);
+		ewf.push_back(0);
 	}
 
-    return;
+	//End of data
+	ewf.back() = 0xFF;
+
+	if(SampleCache && SampleCache->StoreSample(cacheKey, ewf))
+	{
+		fprintf(stderr, "Failed to write cache entry for sample %i\n", sampleIdx);
+	}
+
+	return 0;
 }
 
-void DMFConverter::OutputSample(int sampleIdx, const char* filename, bool convertFormat)
+/** @brief Converts all samples and writes them as instr_XX.ewf, numbered after the instruments.
+    Samples that need resampling are converted in parallel, the files are written in order. **/
+void DMFConverter::OutputSamples(SampleQuality quality)
 {
-	const DMFFile::Sample& sample = m_dmfFile.m_samples[sampleIdx];
-
-	//If correct format, skip conversion
-	const int toleranceHz = 100;
+	int numSamples = m_dmfFile.m_numSamples;
+	std::vector<std::vector<uint8_t> > ewfData(numSamples);
+	std::vector<uint8_t> failed(numSamples, 0);
 
-	if(!convertFormat || (sample.m_bitsPerSample == 8 && abs(DMFFile::sSampleRates[sample.m_sampleRate] - DMFFile::sTargetSampleRate) <= toleranceHz))
+	//Pass-through copies aren't worth a thread
+	int numResampled = 0;
+	for(int i = 0; i < numSamples && quality != SAMPLE_QUALITY_NONE; i++)
 	{
-		uint32_t outputSize = sample.m_sampleSize + 1;
+		numResampled += NeedsResampling(m_dmfFile.m_samples[i]);
+	}
 
-		uint8_t* destDataUint8 = new uint8_t[outputSize];
+	//Inside a -j batch every job gets its share of the cores, not all of them
+	int maxThreads = SampleThreads > 0 ? SampleThreads : (int)std::thread::hardware_concurrency();
+	int numThreads = std::min<int>(numResampled, maxThreads);
 
-		for(int i = 0; i < outputSize - 1; i++)
-		{
-			destDataUint8[i] = ((uint8_t)sample.m_sampleData[i] & 0xFF);
+	if(numThreads <= 1)
+	{
+		SampleBuffers buffers;
+		for(int i = 0; i < numSamples; i++)
+			failed[i] = ConvertSample(i, quality, buffers, ewfData[i]);
+	}
+	else
+	{
+		std::atomic<int> nextSample(0);
+		std::vector<std::thread> workers;
 
-			//Nudge 0xFF bytes to 0xFE
-			if(destDataUint8[i] == 0xFF)
+		for(int i = 0; i < numThreads; i++)
+		{
+			workers.push_back(std::thread([&]()
 			{
-				destDataUint8[i] = 0xFE;
-			}
+				SampleBuffers buffers;
+				for(int j = nextSample++; j < numSamples; j = nextSample++)
+					failed[j] = ConvertSample(j, quality, buffers, ewfData[j]);
+			}));
 		}
 
-		//End of data
-		destDataUint8[outputSize - 1] = 0xFF;
+		for(size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
 
-		if(FILE* file = fopen(filename, "w"))
+	for(int i = 0; i < numSamples; i++)
+	{
+		if(failed[i])
 		{
-			fwrite((char*)destDataUint8, outputSize, 1, file);
-			fclose(file);
+			//SRC error
+			fprintf(stdout, "\tewf\n; sample rate conversion error\n");
+			continue;
 		}
 
+		char filename[FILENAME_MAX] = { 0 };
+		snprintf(filename, FILENAME_MAX, "instr_%02x.ewf", i + TotalInstruments + InstrumentOffset);
+		WriteOutputFile(filename, &ewfData[i][0], ewfData[i].size());
+
 		if(VerboseLog)
 		{
 			fprintf(stdout, "\tewf\n; end of sample\n");
 		}
+	}
+}
+
+/** @brief Converts a compressed DMF module held in memory. The ESF stream and the instrument
+    and sample files are returned in output, nothing is written to disk. ASMOut and ExCommands
+    apply as for the command line tool. **/
+ConvertResult ConvertDMF(const uint8_t* dmfData, size_t dmfSize, const ConvertOptions& options, ConvertOutput& output)
+{
+	output.m_esf.clear();
+	output.m_files.clear();
+	output.m_usedChannels.clear();
+	output.m_numInstruments = 0;
+	output.m_numSamples = 0;
+	output.m_repeatSavings = 0;
+	output.m_costReport.clear();
+
+	ESFOutput* esf = new ESFOutput();
+	DMFConverter* dmf = new DMFConverter(&esf);
+
+	esf->InstrumentOffset = options.m_instrumentOffset;
+	esf->Optimize = options.m_optimize;
+	esf->CostBudget = options.m_costBudget;
+	esf->ReportRepeats = options.m_reportRepeats;
+	dmf->ResampleQuality = (SampleQuality)options.m_sampleQuality;
+	dmf->SampleCache = options.m_sampleCache;
+	dmf->SampleThreads = options.m_sampleThreads;
+	dmf->Memoize = options.m_memoize;
+	dmf->InstrumentOffset = options.m_instrumentOffset;
+	dmf->PALMode = options.m_PALMode;
+	dmf->LoopWholeTrack = options.m_loopWholeTrack;
+	dmf->LockChannels = options.m_lockChannels;
+	dmf->OutputFiles = &output.m_files;
+
+	if(options.m_useTables)
+	{
+		dmf->UseTables = true;
+		memcpy(dmf->InstrumentTable, options.m_instrumentTable, sizeof(dmf->InstrumentTable));
+		memcpy(dmf->SampleTable, options.m_sampleTable, sizeof(dmf->SampleTable));
+	}
+
+	ConvertResult result = CONVERT_OK;
 
-		delete destDataUint8;
+	if(dmf->Initialize(dmfData, dmfSize))
+	{
+		result = CONVERT_INVALID_MODULE;
+	}
+	else if(dmf->System != DMF_SYSTEM_GENESIS && dmf->System != DMF_SYSTEM_SMS)
+	{
+		result = CONVERT_UNSUPPORTED_SYSTEM;
+	}
+	else if(dmf->Parse())
+	{
+		result = CONVERT_PARSE_FAILED;
 	}
 	else
 	{
-		float* sourceDataFloat = new float[sample.m_sampleSize];
-		float* destDataFloat = new float[sample.m_sampleSize * 2];
+		output.m_esf = esf->GetData();
+		output.m_repeatSavings = esf->RepeatSavings;
+		output.m_costReport = esf->CostReport;
+		output.m_numInstruments = dmf->TotalInstruments;
+		output.m_numSamples = dmf->TotalSamples;
+		output.m_usedChannels = dmf->UsedChannels;
+	}
 
-		if(sample.m_bitsPerSample == 8)
-		{
-			//Source data to float
-			for(int i = 0; i < sample.m_sampleSize; i++)
-			{
-				sourceDataFloat[i] = (float)((uint8_t)sample.m_sampleData[i] & 0xFF) / 255.0f;
-			}
-		}
-		else if(sample.m_bitsPerSample == 16)
-		{
-			//Source data to float
-			for(int i = 0; i < sample.m_sampleSize; i++)
-			{
-				sourceDataFloat[i] = (float)sample.m_sampleData[i] / 32767.0f;
-			}
-		}
+	if(result != CONVERT_OK)
+	{
+		output.m_files.clear();
+	}
 
-		//Sample rate conversion using Secret Rabbit Code (http://www.mega-nerd.com/SRC)
-		SRC_DATA srcConfig;
-		srcConfig.data_in = sourceDataFloat;
-		srcConfig.data_out = destDataFloat;
-		srcConfig.input_frames = sample.m_sampleSize;
-		srcConfig.output_frames = sample.m_sampleSize * 2;
-		srcConfig.src_ratio = (double)DMFFile::sTargetSampleRate / (double)DMFFile::sSampleRates[sample.m_sampleRate];
+	delete dmf;
+	delete esf;
+	return result;
+}
 
-		int srcResult = src_simple(&srcConfig, SRC_SINC_BEST_QUALITY, 1);
-		if(srcResult == 0)
-		{
-			//Convert back to u8
-			uint32_t outputSize = srcConfig.output_frames_gen + 1;
+/** @brief Converts a DMF file in memory, see ConvertDMF() **/
+ConvertResult ConvertDMFFile(const char* Filename, const ConvertOptions& options, ConvertOutput& output)
+{
+	MappedFile file(Filename);
+	if(!file.IsOpen())
+	{
+		fprintf(stderr, "File not found: %s\n", Filename);
+		return CONVERT_IO_ERROR;
+	}
 
-			uint8_t* destDataUint8 = new uint8_t[outputSize];
+	return ConvertDMF(file.GetData(), file.GetSize(), options, output);
+}
 
-			for(int i = 0; i < outputSize - 1; i++)
-			{
-				destDataUint8[i] = (uint8_t)((destDataFloat[i] + 1.0f) * 128.0f);
+/** @brief Converts a module with and without pattern memoization and compares everything written.
+    Replaying only works if ParseState holds all state that changes the output, this catches state
+    added to the converter but not to ParseState. With the peephole pass on, the stream is also
+    replayed against one written without it. Returns true if the outputs differ. **/
+bool CheckMemoization(const char* Filename, const ConvertOptions& options)
+{
+	MappedFile file(Filename);
+	if(!file.IsOpen())
+	{
+		fprintf(stderr, "File not found: %s\n", Filename);
+		return 1;
+	}
 
-				//Nudge 0xFF bytes to 0xFE
-				if(destDataUint8[i] == 0xFF)
-				{
-					destDataUint8[i] = 0xFE;
-				}
-			}
+	ConvertOptions fullOptions = options;
+	fullOptions.m_memoize = false;
 
-			//End of data
-			destDataUint8[outputSize - 1] = 0xFF;
+	ConvertOutput memoized, full;
+	ConvertResult memoizedResult = ConvertDMF(file.GetData(), file.GetSize(), options, memoized);
+	ConvertResult fullResult = ConvertDMF(file.GetData(), file.GetSize(), fullOptions, full);
 
-			if(FILE* file = fopen(filename, "w"))
-			{
-				fwrite((char*)destDataUint8, outputSize, 1, file);
-				fclose(file);
-			}
+	if(memoizedResult != fullResult)
+	{
+		fprintf(stderr, "Memoization check: %s converts with %i memoized, %i without\n", Filename, memoizedResult, fullResult);
+		return 1;
+	}
 
-			if(VerboseLog)
-			{
-				fprintf(stdout, "\tewf\n; end of sample\n");
-			}
+	if(memoized.m_esf != full.m_esf)
+	{
+		size_t offset = 0;
+		while(offset < memoized.m_esf.size() && offset < full.m_esf.size() && memoized.m_esf[offset] == full.m_esf[offset])
+			offset++;
 
-			delete destDataUint8;
-		}
-		else
+		fprintf(stderr, "Memoization check: %s ESF differs from byte %lu\n", Filename, (unsigned long)offset);
+		return 1;
+	}
+
+	bool filesDiffer = memoized.m_files.size() != full.m_files.size();
+	for(size_t i = 0; i < memoized.m_files.size() && !filesDiffer; i++)
+	{
+		filesDiffer = memoized.m_files[i].m_name != full.m_files[i].m_name || memoized.m_files[i].m_data != full.m_files[i].m_data;
+	}
+
+	if(filesDiffer || memoized.m_usedChannels != full.m_usedChannels)
+	{
+		fprintf(stderr, "Memoization check: %s instruments, samples or channels differ\n", Filename);
+		return 1;
+	}
+
+	//The peephole pass may only drop commands that can't be heard, replay both streams to compare
+	if(options.m_optimize && !ASMOut && fullResult == CONVERT_OK)
+	{
+		ConvertOptions unoptimizedOptions = fullOptions;
+		unoptimizedOptions.m_optimize = false;
+
+		ConvertOutput unoptimized;
+		std::vector<int32_t> trace, unoptimizedTrace;
+		if(ConvertDMF(file.GetData(), file.GetSize(), unoptimizedOptions, unoptimized) != CONVERT_OK
+			|| ReplayESF(full.m_esf, trace) || ReplayESF(unoptimized.m_esf, unoptimizedTrace))
 		{
-			//SRC error
-			fprintf(stdout, "\tewf\n; sample rate conversion error\n");
+			fprintf(stderr, "Memoization check: %s can't be replayed without the peephole pass\n", Filename);
+			return 1;
 		}
 
-		delete sourceDataFloat;
-		delete destDataFloat;
+		if(trace != unoptimizedTrace)
+		{
+			size_t offset = 0;
+			while(offset < trace.size() && offset < unoptimizedTrace.size() && trace[offset] == unoptimizedTrace[offset])
+				offset++;
+
+			fprintf(stderr, "Memoization check: %s plays differently without the peephole pass, from trace entry %lu\n", Filename, (unsigned long)offset);
+			return 1;
+		}
 	}
+
+	fprintf(stdout, "Memoization check passed for %s\n", Filename);
+	return 0;
 }
 
+/** @brief Reads the module. Counts that don't fit the fixed tables and data running past the
+    end of the buffer fail the stream, the caller must check Stream::Failed(). **/
 void DMFFile::Serialise(Stream& stream)
 {
 	//Format string, version, system, song and author name
 	stream.Serialise(m_formatString, sFormatStringSize);
 	stream.Serialise(m_fileVersion);
 	stream.Serialise(m_systemType);
+	if(m_systemType >= sizeof(ChannelCount) / sizeof(ChannelCount[0]))
+	{
+		stream.Fail();
+		return;
+	}
 	stream.Serialise(m_songName);
 	stream.Serialise(m_songAuthor);
 
@@ -1339,25 +2396,37 @@ void DMFFile::Serialise(Stream& stream)
 	}
 
 	stream.Serialise(m_numPatternPages);
+	if(m_numNoteRowsPerPattern == 0 || m_numNoteRowsPerPattern > sMaxRowsPerPattern || m_numPatternPages == 0)
+	{
+		stream.Fail();
+		return;
+	}
 
 	if(m_fileVersion < DMFVersion_12_0)
 	{
 		stream.Serialise(m_arpeggioTickSpeed);
 	}
+	else
+	{
+		//Newer modules always step arpeggios every tick
+		m_arpeggioTickSpeed = 1;
+	}
 
 	//Channels
 	const int channelCount = ChannelCount[m_systemType];
 	for(int i = 0; i < channelCount; i++)
 	{
-		m_patternMatrix[i] = new uint8_t[m_numPatternPages];
-		for(int j = 0; j < m_numPatternPages; j++)
-		{
-			stream.Serialise(m_patternMatrix[i][j]);
-		}
+		m_patternMatrix[i] = stream.View(m_numPatternPages);
 	}
 
 	//Instruments
 	stream.Serialise(m_numInstruments);
+	if(m_numInstruments > sMaxInstruments)
+	{
+		stream.Fail();
+		return;
+	}
+
 	for(int i = 0; i < m_numInstruments; i++)
 	{
 		stream.Serialise(m_instruments[i]);
@@ -1365,6 +2434,12 @@ void DMFFile::Serialise(Stream& stream)
 
 	//Wave tables
 	stream.Serialise(m_numWaveTables);
+	if(m_numWaveTables > sMaxWaveTables)
+	{
+		stream.Fail();
+		return;
+	}
+
 	for(int i = 0; i < m_numWaveTables; i++)
 	{
 		stream.Serialise(m_waveTables[i]);
@@ -1377,48 +2452,183 @@ void DMFFile::Serialise(Stream& stream)
 
 		stream.Serialise(channel.m_numEffects);
 
-		if(stream.GetDirection() == Stream::STREAM_IN)
-		{
-			channel.m_patternPages = new Channel::PatternPage[m_numPatternPages];
-		}
+		//Note pattern pages, indexed in place
+		channel.m_numRows = m_numNoteRowsPerPattern;
+		channel.m_rowSize = (4 + 2 * channel.m_numEffects) * sizeof(uint16_t);
+		channel.m_patternData = stream.View((uint64_t)m_numPatternPages * m_numNoteRowsPerPattern * channel.m_rowSize);
+	}
+
+	//Samples
+	stream.Serialise(m_numSamples);
+	if(m_numSamples > sMaxSamples)
+	{
+		stream.Fail();
+		return;
+	}
 
-		//Note pattern pages
-		for(int patternPageIdx = 0; patternPageIdx < m_numPatternPages; patternPageIdx++)
+	for(int i = 0; i < m_numSamples; i++)
+	{
+		stream.Serialise(m_samples[i]);
+	}
+}
+
+/** @brief Indexes the pattern data without unpacking it. Each channel's order positions are mapped
+    to slots, one per physical pattern, and each slot is scanned once for what the song contains. **/
+void PatternStore::Build(const DMFFile& dmfFile, int channelCount, Arena& arena)
+{
+	m_numChannels = channelCount;
+	m_numRows = dmfFile.m_numNoteRowsPerPattern;
+
+	uint32_t maskWords = (m_numRows + 31) >> 5;
+
+	m_rowMask = arena.Alloc<uint32_t>(maskWords);
+	memset(m_rowMask, 0, maskWords * sizeof(uint32_t));
+
+	for(int chan = 0; chan < channelCount; chan++)
+	{
+		const DMFFile::Channel& channel = dmfFile.m_channels[chan];
+		Column& column = m_columns[chan];
+
+		//One slot per physical pattern. Deflemask stores a copy for every order position, a copy
+		//that doesn't match the first one for its pattern ID gets a slot of its own.
+		const uint32_t patternSize = m_numRows * channel.m_rowSize;
+		int idSlots[256];
+		uint32_t slotPages[256];
+		for(int i = 0; i < 256; i++)
+			idSlots[i] = -1;
+
+		column.m_source = &channel;
+		column.m_loadedSlot = -1;
+		column.m_pageSlots = arena.Alloc<uint8_t>(dmfFile.m_numPatternPages);
+		column.m_slotFlags = arena.Alloc<uint8_t>(dmfFile.m_numPatternPages);
+		column.m_numSlots = 0;
+		column.m_numRows = m_numRows;
+		column.m_numEffects = channel.m_numEffects;
+		column.m_hasNotes = false;
+		column.m_occupied = false;
+
+		for(uint32_t page = 0; page < dmfFile.m_numPatternPages; page++)
 		{
-			Channel::PatternPage& patternPage = channel.m_patternPages[patternPageIdx];
+			uint8_t patternId = dmfFile.m_patternMatrix[chan][page];
+			int slot = idSlots[patternId];
 
-			if(stream.GetDirection() == Stream::STREAM_IN)
+			if(slot < 0 || memcmp(channel.GetRow(page, 0), channel.GetRow(slotPages[slot], 0), patternSize))
 			{
-				patternPage.m_notes = new Channel::PatternPage::Note[m_numNoteRowsPerPattern];
-			}
+				slot = column.m_numSlots++;
+				slotPages[slot] = page;
+				if(idSlots[patternId] < 0)
+					idSlots[patternId] = slot;
+
+				//Scan the new pattern in place
+				uint8_t flags = 0;
+				for(uint32_t row = 0; row < m_numRows; row++)
+				{
+					const uint8_t* ptr = channel.GetRow(page, row);
+					uint8_t note = Stream::ReadU16(ptr);
+					bool occupied = note != 0 || (uint8_t)Stream::ReadU16(ptr + 4) != 0xff;
 
-			//Notes
-			for(int noteIdx = 0; noteIdx < m_numNoteRowsPerPattern; noteIdx++)
-			{
-				Channel::PatternPage::Note& note = patternPage.m_notes[noteIdx];
+					for(int effectIdx = 0; effectIdx < column.m_numEffects; effectIdx++)
+					{
+						uint8_t type = Stream::ReadU16(ptr + 6 + effectIdx * 4);
+						if(type == EFFECT_TYPE_JUMP)
+							flags |= SLOT_HAS_JUMP;
+						else if(type == EFFECT_TYPE_BREAK)
+							flags |= SLOT_HAS_BREAK;
+						occupied |= type != EFFECT_TYPE_NONE;
+					}
 
-				stream.Serialise(note.m_note);
-				stream.Serialise(note.m_octave);
-				stream.Serialise(note.m_volume);
+					//The octave alone is ignored, it is only read along with a note
+					occupied |= (uint8_t)Stream::ReadU16(ptr + 6 + column.m_numEffects * 4) != 0xff;
 
-				//Note effects
-				for(int effectIdx = 0; effectIdx < channel.m_numEffects; effectIdx++)
-				{
-					stream.Serialise(note.m_effects[effectIdx].m_effectType);
-					stream.Serialise(note.m_effects[effectIdx].m_effectValue);
+					if(note != 0 && note != NOTE_OFF)
+						column.m_hasNotes = true;
+					column.m_occupied |= occupied;
 				}
-
-				stream.Serialise(note.m_instrument);
+				column.m_slotFlags[slot] = flags;
 			}
+
+			column.m_pageSlots[page] = slot;
 		}
+
+		//Room for one pattern, reused by every load
+		column.m_notes = arena.Alloc<uint8_t>(m_numRows);
+		column.m_octaves = arena.Alloc<uint8_t>(m_numRows);
+		column.m_volumes = arena.Alloc<uint8_t>(m_numRows);
+		column.m_instruments = arena.Alloc<uint8_t>(m_numRows);
+		column.m_effects = arena.Alloc<Effect>(m_numRows * column.m_numEffects);
+		column.m_effectMask = arena.Alloc<uint32_t>(maskWords);
+		column.m_occupiedMask = arena.Alloc<uint32_t>(maskWords);
 	}
+}
 
-	//Samples
-	stream.Serialise(m_numSamples);
-	for(int i = 0; i < m_numSamples; i++)
+/** @brief Unpacks one channel's pattern at an order position, unless it is already loaded. Note,
+    octave, volume, instrument and effect values are truncated to the 8 bits the interpreter uses. **/
+void PatternStore::LoadColumn(int chan, uint32_t page)
+{
+	Column& column = m_columns[chan];
+
+	int slot = column.m_pageSlots[page];
+	if(slot == column.m_loadedSlot)
+		return;
+
+	column.m_loadedSlot = slot;
+
+	uint32_t maskWords = (m_numRows + 31) >> 5;
+	memset(column.m_effectMask, 0, maskWords * sizeof(uint32_t));
+	memset(column.m_occupiedMask, 0, maskWords * sizeof(uint32_t));
+
+	for(uint32_t row = 0; row < m_numRows; row++)
 	{
-		stream.Serialise(m_samples[i]);
+		const uint8_t* ptr = column.m_source->GetRow(page, row);
+		column.m_notes[row] = Stream::ReadU16(ptr);
+		column.m_octaves[row] = Stream::ReadU16(ptr + 2);
+		column.m_volumes[row] = Stream::ReadU16(ptr + 4);
+		ptr += 6;
+
+		Effect* effects = &column.m_effects[row * column.m_numEffects];
+		for(int effectIdx = 0; effectIdx < column.m_numEffects; effectIdx++)
+		{
+			effects[effectIdx].m_type = Stream::ReadU16(ptr);
+			effects[effectIdx].m_value = Stream::ReadU16(ptr + 2);
+			ptr += 4;
+
+			if(effects[effectIdx].m_type != EFFECT_TYPE_NONE)
+				SetBit(column.m_effectMask, row);
+		}
+
+		column.m_instruments[row] = Stream::ReadU16(ptr);
+
+		//The octave alone is ignored, it is only read along with a note
+		if(column.m_notes[row] != 0 || column.m_volumes[row] != 0xff || column.m_instruments[row] != 0xff || column.HasEffects(row))
+			SetBit(column.m_occupiedMask, row);
+	}
+}
+
+/** @brief Unpacks every channel's pattern at an order position and marks its occupied rows **/
+void PatternStore::LoadPage(uint32_t page)
+{
+	uint32_t maskWords = (m_numRows + 31) >> 5;
+	memset(m_rowMask, 0, maskWords * sizeof(uint32_t));
+
+	for(int chan = 0; chan < m_numChannels; chan++)
+	{
+		LoadColumn(chan, page);
+
+		const Column& column = m_columns[chan];
+		for(uint32_t i = 0; i < maskWords; i++)
+			m_rowMask[i] |= column.m_occupiedMask[i];
+	}
+}
+
+/** @brief Returns true if any channel's pattern at an order position has one of the SlotFlags **/
+bool PatternStore::HasSlotFlags(uint32_t page, uint8_t flags) const
+{
+	for(int chan = 0; chan < m_numChannels; chan++)
+	{
+		if(m_columns[chan].GetSlotFlags(page) & flags)
+			return true;
 	}
+	return false;
 }
 
 void DMFFile::Instrument::Serialise(Stream& stream)
@@ -1485,32 +2695,23 @@ void DMFFile::Instrument::ParamDataPSG::Envelope::Serialise(Stream& stream)
 	stream.Serialise(envelopeSize);
 
 	//Envelope values
-	envelopeData = new int32_t[envelopeSize];
-	for(int i = 0; i < envelopeSize; i++)
-	{
-		stream.Serialise(envelopeData[i]);
-	}
+	envelopeData = stream.View(envelopeSize * sizeof(int32_t));
 
-	//Loop position
+	//Loop position, an empty envelope has none stored and doesn't loop
 	if(envelopeSize > 0)
 	{
 		stream.Serialise(loopPosition);
 	}
+	else
+	{
+		loopPosition = 255;
+	}
 }
 
 void DMFFile::WaveTable::Serialise(Stream& stream)
 {
 	stream.Serialise(m_waveTableSize);
-
-	if(stream.GetDirection() == Stream::STREAM_IN)
-	{
-		m_waveTableData = new uint32_t[m_waveTableSize];
-	}
-
-	for(int i = 0; i < m_waveTableSize; i++)
-	{
-		stream.Serialise(m_waveTableData[i]);
-	}
+	m_waveTableData = stream.View((uint64_t)m_waveTableSize * sizeof(uint32_t));
 }
 
 void DMFFile::Sample::Serialise(Stream& stream)
@@ -1521,14 +2722,5 @@ void DMFFile::Sample::Serialise(Stream& stream)
 	stream.Serialise(m_pitch);
 	stream.Serialise(m_amplitude);
 	stream.Serialise(m_bitsPerSample);
-
-	if(stream.GetDirection() == Stream::STREAM_IN)
-	{
-		m_sampleData = new uint16_t[m_sampleSize];
-	}
-
-	for(int i = 0; i < m_sampleSize; i++)
-	{
-		stream.Serialise(m_sampleData[i]);
-	}
+	m_sampleData = stream.View((uint64_t)m_sampleSize * sizeof(uint16_t));
 }
@@ -5,17 +5,24 @@ ESFOutput::ESFOutput(string Filename)
 {
     WaitCounter = 0;
 	VerboseLog = false;
+	Optimize = true;
+	ReportRepeats = false;
+	RepeatSavings = 0;
+	CostBudget = 0;
+	InstrumentOffset = 0;
 
     /* Open file. ASM should be in text format, and binaries, well binary obviously */
     if(ASMOut)
-        ESFFile.open(Filename.c_str(), ios_base::out | ios_base::trunc);
+        OutFile = fopen(Filename.c_str(), "w");
     else
-        ESFFile.open(Filename.c_str(), ios_base::out | ios_base::trunc | ios_base::binary);
+        OutFile = fopen(Filename.c_str(), "wb");
 
-    if(!ESFFile.is_open())
+    //Other jobs may still be running, so leave giving up to the caller
+    OpenFailed = !OutFile;
+    if(OpenFailed)
     {
-        fprintf(stderr, "Failed to open output. Aborting...\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Failed to open output: %s\n", Filename.c_str());
+        return;
     }
     if(ASMOut)
     {
@@ -23,36 +30,171 @@ ESFOutput::ESFOutput(string Filename)
 
 		if(VerboseLog)
 		{
-			ESFFile << "; Generated by DMF2ESF ver " << MAJORVER << "." << MINORVER << " (built " << __DATE__ << " " << __TIME__")\n";
+			ASMFile << "; Generated by DMF2ESF ver " << MAJORVER << "." << MINORVER << " (built " << __DATE__ << " " << __TIME__")\n";
 		}
     }
     return;
 }
 
+/** @brief Creates an output that is only kept in memory, see GetData() */
+ESFOutput::ESFOutput()
+{
+    WaitCounter = 0;
+	VerboseLog = false;
+	Optimize = true;
+	ReportRepeats = false;
+	RepeatSavings = 0;
+	CostBudget = 0;
+	InstrumentOffset = 0;
+	OutFile = NULL;
+	OpenFailed = false;
+}
+
 ESFOutput::~ESFOutput() // dtor
 {
     /* Cleanup */
-    ESFFile.close();
+    Close();
+}
+
+/** @brief Returns the commands written so far (the listing text when writing ASM) */
+const std::vector<uint8_t>& ESFOutput::GetData()
+{
+	Flush();
+
+	if(ASMOut)
+	{
+		//Move any new listing text into the buffer
+		std::string text = ASMFile.str();
+		Buffer.insert(Buffer.end(), text.begin(), text.end());
+		ASMFile.str("");
+	}
+
+	return Buffer;
+}
+
+/** @brief Writes the buffered output to the file in one go and closes it */
+void ESFOutput::Close()
+{
+	if(!OutFile)
+		return;
+
+	const std::vector<uint8_t>& data = GetData();
+
+	if(!data.empty() && fwrite(&data[0], 1, data.size(), OutFile) != data.size())
+	{
+		fprintf(stderr, "Failed to write output.\n");
+	}
+
+	fclose(OutFile);
+	OutFile = NULL;
 }
 
 void ESFOutput::Wait()
 {
-    while(WaitCounter > 255)
+    if(WaitCounter == 0)
+        return;
+
+    AddEvent(ESFEvent::DELAY, 0, 0, WaitCounter);
+    WaitCounter = 0;
+    return;
+}
+
+/** @brief Records an event, nothing is written until Flush() */
+void ESFOutput::AddEvent(uint8_t type, uint8_t chan, uint16_t value, uint32_t value2)
+{
+    ESFEvent event;
+    event.m_type = type;
+    event.m_channel = chan;
+    event.m_value = value;
+    event.m_value2 = value2;
+    Events.push_back(event);
+}
+
+/** @brief Copies the events recorded since first */
+void ESFOutput::GetEvents(size_t first, std::vector<ESFEvent>& events) const
+{
+    events.assign(Events.begin() + first, Events.end());
+}
+
+/** @brief Records events captured with GetEvents again, listing comments are moved to pattern */
+void ESFOutput::ReplayEvents(const std::vector<ESFEvent>& events, uint8_t pattern)
+{
+    size_t first = Events.size();
+    Events.insert(Events.end(), events.begin(), events.end());
+
+    for(size_t i = first; i < Events.size(); i++)
+    {
+        if(Events[i].m_type == ESFEvent::PATTERN_ROW)
+            Events[i].m_value = pattern;
+    }
+}
+
+/** @brief Optimises the recorded events and writes them out as binary or ASM */
+void ESFOutput::Flush()
+{
+    if(Events.empty())
+        return;
+
+    if(Optimize)
+    {
+        OptimizeEvents(Events);
+    }
+
+    if(CostBudget)
+    {
+        CostReport = GetCostReport(Events, CostBudget);
+    }
+
+    if(ReportRepeats)
+    {
+        RepeatSavings = GetRepeatSavings(Events);
+    }
+
+    for(size_t i = 0; i < Events.size(); i++)
+    {
+        const ESFEvent& event = Events[i];
+        ESFChannel chan = (ESFChannel)event.m_channel;
+
+        switch(event.m_type)
+        {
+        case ESFEvent::NOTE_ON:            WriteNoteOn(chan, event.m_value, event.m_value2); break;
+        case ESFEvent::NOTE_OFF:           WriteNoteOff(chan); break;
+        case ESFEvent::SET_VOLUME:         WriteVolume(chan, event.m_value); break;
+        case ESFEvent::SET_FREQUENCY:      WriteFrequency(chan, event.m_value); break;
+        case ESFEvent::SET_INSTRUMENT:     WriteInstrument(chan, event.m_value); break;
+        case ESFEvent::LOCK_CHANNEL:       WriteLockChannel(chan); break;
+        case ESFEvent::SET_PARAMS:         WriteParams(chan, event.m_value); break;
+        case ESFEvent::SET_REGISTER_BANK0: WriteRegisterBank0(event.m_value, event.m_value2); break;
+        case ESFEvent::SET_REGISTER_BANK1: WriteRegisterBank1(event.m_value, event.m_value2); break;
+        case ESFEvent::GOTO_LOOP:          WriteGotoLoop(); break;
+        case ESFEvent::SET_LOOP:           WriteSetLoop(); break;
+        case ESFEvent::STOP_PLAYBACK:      WriteStopPlayback(); break;
+        case ESFEvent::DELAY:              WriteDelay(event.m_value2); break;
+        case ESFEvent::PATTERN_ROW:        WritePatRow(event.m_value, event.m_value2); break;
+        }
+    }
+
+    Events.clear();
+}
+
+/** @brief Splits a delay into the 8-bit delay commands */
+void ESFOutput::WriteDelay(uint32_t ticks)
+{
+    while(ticks > 255)
     {
         this->SetDelay(0);
-        WaitCounter = WaitCounter - 256;
-        //fprintf(stderr, "waitcounter a %d\n", WaitCounter);
+        ticks = ticks - 256;
+        //fprintf(stderr, "waitcounter a %d\n", ticks);
     }
 
-    if(WaitCounter == 0)
+    if(ticks == 0)
         return;
 
-    if(WaitCounter <= 16 && ExCommands)
-        this->SetShortDelay((uint8_t) WaitCounter);
+    if(ticks <= 16 && ExCommands)
+        this->SetShortDelay((uint8_t) ticks);
     else
-        this->SetDelay((uint8_t) WaitCounter);
-    //fprintf(stderr, "waitcounter b %d\n", WaitCounter);
-    WaitCounter = 0;
+        this->SetDelay((uint8_t) ticks);
+    //fprintf(stderr, "waitcounter b %d\n", ticks);
     return;
 }
 
@@ -60,7 +202,11 @@ void ESFOutput::Wait()
 void ESFOutput::NoteOn(ESFChannel chan, uint8_t note, uint8_t octave)
 {
     this->Wait();
+    AddEvent(ESFEvent::NOTE_ON, chan, note, octave);
+}
 
+void ESFOutput::WriteNoteOn(ESFChannel chan, uint8_t note, uint8_t octave)
+{
     uint8_t esfnote;
     uint8_t esfcmd = 0x00+(int)chan;
 
@@ -83,41 +229,50 @@ void ESFOutput::NoteOn(ESFChannel chan, uint8_t note, uint8_t octave)
     if(ASMOut)
     {
         //fprintf(ESFFile, "\tdc.b $%02x, $%02x\t; Note on note %d, octave %d\n",(int)esfcmd,(int)esfnote,(int)note,(int)octave);
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,esfnote,", $");
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,esfnote,", $");
         if(ESFChannelTypes[(int)chan] != CHANNEL_TYPE_FM6)
-            ESFFile<<"\t; Note "<<NoteNames[note].c_str()<<(int)octave<<" on channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+            ASMFile<<"\t; Note "<<NoteNames[note].c_str()<<(int)octave<<" on channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         else
-            ESFFile<<"\t; Sample "<<(int)note<<" on channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+            ASMFile<<"\t; Sample "<<(int)note<<" on channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
     // binary here
-    ESFFile<<esfcmd<<esfnote;
+    Put(esfcmd);
+    Put(esfnote);
     return;
 }
 
 void ESFOutput::NoteOff(ESFChannel chan)
 {
     this->Wait();
+    AddEvent(ESFEvent::NOTE_OFF, chan);
+}
 
+void ESFOutput::WriteNoteOff(ESFChannel chan)
+{
     uint8_t esfcmd = 0x10+(int)chan;
     if(ASMOut)
     {
         //fprintf(ESFFile, "\tdc.b $%02x\t; Note off",(int)esfcmd);
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        ESFFile<<"\t\t; Note off channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        ASMFile<<"\t\t; Note off channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
 void ESFOutput::SetVolume(ESFChannel chan, uint8_t volume)
 {
 	this->Wait();
+    AddEvent(ESFEvent::SET_VOLUME, chan, volume);
+}
 
+void ESFOutput::WriteVolume(ESFChannel chan, uint8_t volume)
+{
     uint8_t esfcmd = 0x20+(int)chan;
     uint8_t esfvol;
 
@@ -129,13 +284,14 @@ void ESFOutput::SetVolume(ESFChannel chan, uint8_t volume)
     if(ASMOut)
     {
         //fprintf(ESFFile, "\tdc.b $%02x, $%02x\t; Volume",(int)esfcmd,(int)esfvol);
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,esfvol,", $");
-        ESFFile<<"\t; Set volume for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,esfvol,", $");
+        ASMFile<<"\t; Set volume for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
-    ESFFile<<esfcmd<<esfvol;
+    Put(esfcmd);
+    Put(esfvol);
     return;
 }
 /*
@@ -168,7 +324,12 @@ void ESFOutput::SetFrequency(ESFChannel chan, uint16_t freq, bool processDelay)
 	{
 		this->Wait();
 	}
-    
+
+    AddEvent(ESFEvent::SET_FREQUENCY, chan, freq);
+}
+
+void ESFOutput::WriteFrequency(ESFChannel chan, uint16_t freq)
+{
     uint8_t esfcmd = 0x30+(int)chan;
     uint8_t esffreq1 = 0;
     uint8_t esffreq2 = 0;
@@ -196,51 +357,62 @@ void ESFOutput::SetFrequency(ESFChannel chan, uint16_t freq, bool processDelay)
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,esffreq1,", $");
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,esffreq1,", $");
         if(!onebyte)
-            hexy(ESFFile,esffreq2,", $");
-		ESFFile << "\t; Set frequency '" << std::dec << (int)freq << "' (octave " << (int)(freq >> 11) << " semitone " << (int)(freq & 0x7FF) << ") for channel " << ESFChanNames[(int)chan].c_str() << "\n";
+            hexy(ASMFile,esffreq2,", $");
+		ASMFile << "\t; Set frequency '" << std::dec << (int)freq << "' (octave " << (int)(freq >> 11) << " semitone " << (int)(freq & 0x7FF) << ") for channel " << ESFChanNames[(int)chan].c_str() << "\n";
         return;
     }
-    ESFFile<<esfcmd<<esffreq1;
+    Put(esfcmd);
+    Put(esffreq1);
     if(!onebyte)
-        ESFFile<<esffreq2;
+        Put(esffreq2);
     return;
 }
 
 void ESFOutput::SetInstrument(ESFChannel chan, uint8_t index)
 {
     this->Wait();
+    AddEvent(ESFEvent::SET_INSTRUMENT, chan, (uint8_t)(index + InstrumentOffset));
+}
+
+void ESFOutput::WriteInstrument(ESFChannel chan, uint8_t index)
+{
     uint8_t esfcmd = 0x40+(int)chan;
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-		hexy(ESFFile, index + InstrumentOffset, ", $");
-        ESFFile<<"\t; Set instrument for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+		hexy(ASMFile, index, ", $");
+        ASMFile<<"\t; Set instrument for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
-    ESFFile<<esfcmd<<(index+InstrumentOffset);
+    Put(esfcmd);
+    Put(index);
     return;
 }
 
 void ESFOutput::LockChannel(ESFChannel chan)
 {
     this->Wait();
+    AddEvent(ESFEvent::LOCK_CHANNEL, chan);
+}
 
+void ESFOutput::WriteLockChannel(ESFChannel chan)
+{
     uint8_t esfcmd = 0xe0+(int)chan;
     if(ASMOut)
     {
         //fprintf(ESFFile, "\tdc.b $%02x\t; Note off",(int)esfcmd);
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        ESFFile<<"\t\t; Lock channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        ASMFile<<"\t\t; Lock channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
@@ -248,102 +420,137 @@ void ESFOutput::LockChannel(ESFChannel chan)
 void ESFOutput::SetParams(ESFChannel chan, uint8_t params)
 {
     this->Wait();
+    AddEvent(ESFEvent::SET_PARAMS, chan, params);
+}
+
+void ESFOutput::WriteParams(ESFChannel chan, uint8_t params)
+{
     uint8_t esfcmd = 0xf0+(int)chan;
     uint8_t esfparams = params & 0xC0;
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,esfparams,", $");
-        ESFFile<<"\t; Set params for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,esfparams,", $");
+        ASMFile<<"\t; Set params for channel "<<ESFChanNames[(int)chan].c_str()<<"\n";
         return;
     }
-    ESFFile<<esfcmd<<esfparams;
+    Put(esfcmd);
+    Put(esfparams);
     return;
 }
 
 void ESFOutput::SetRegisterBank0(uint8_t reg, uint8_t value)
 {
-	uint16_t esfcmd = 0xF8;
+	AddEvent(ESFEvent::SET_REGISTER_BANK0, 0, reg, value);
+}
+
+void ESFOutput::WriteRegisterBank0(uint8_t reg, uint8_t value)
+{
+	uint8_t esfcmd = 0xF8;
 
 	if(ASMOut)
 	{
-		ESFFile << "\tdc.b ";
-		hexy(ESFFile, esfcmd, "$");
-		hexy(ESFFile, reg, ", $");
-		hexy(ESFFile, value, ", $");
-		ESFFile << "\t; Set FM register " << (int)reg << " to value " << (int)value << "\n";
+		ASMFile << "\tdc.b ";
+		hexy(ASMFile, esfcmd, "$");
+		hexy(ASMFile, reg, ", $");
+		hexy(ASMFile, value, ", $");
+		ASMFile << "\t; Set FM register " << (int)reg << " to value " << (int)value << "\n";
 	}
 	else
 	{
-		ESFFile << esfcmd;
+		Put(esfcmd);
+		Put(reg);
+		Put(value);
 	}
 }
 
 void ESFOutput::SetRegisterBank1(uint8_t reg, uint8_t value)
 {
-	uint16_t esfcmd = 0xF9;
+	AddEvent(ESFEvent::SET_REGISTER_BANK1, 0, reg, value);
+}
+
+void ESFOutput::WriteRegisterBank1(uint8_t reg, uint8_t value)
+{
+	uint8_t esfcmd = 0xF9;
 
 	if(ASMOut)
 	{
-		ESFFile << "\tdc.b ";
-		hexy(ESFFile, esfcmd, "$");
-		hexy(ESFFile, reg, ", $");
-		hexy(ESFFile, value, ", $");
-		ESFFile << "\t; Set FM register " << (int)reg << " to value " << (int)value << "\n";
+		ASMFile << "\tdc.b ";
+		hexy(ASMFile, esfcmd, "$");
+		hexy(ASMFile, reg, ", $");
+		hexy(ASMFile, value, ", $");
+		ASMFile << "\t; Set FM register " << (int)reg << " to value " << (int)value << "\n";
 	}
 	else
 	{
-		ESFFile << esfcmd;
+		Put(esfcmd);
+		Put(reg);
+		Put(value);
 	}
 }
 
 void ESFOutput::GotoLoop()
 {
     this->Wait();
+    AddEvent(ESFEvent::GOTO_LOOP);
+}
+
+void ESFOutput::WriteGotoLoop()
+{
     uint8_t esfcmd = 0xfc;
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        ESFFile<<"\t; Goto loop\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        ASMFile<<"\t; Goto loop\n";
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
 void ESFOutput::SetLoop()
 {
     this->Wait();
+    AddEvent(ESFEvent::SET_LOOP);
+}
+
+void ESFOutput::WriteSetLoop()
+{
     uint8_t esfcmd = 0xfd;
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        ESFFile<<"\t; Set loop\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        ASMFile<<"\t; Set loop\n";
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
 void ESFOutput::StopPlayback()
 {
     this->Wait();
+    AddEvent(ESFEvent::STOP_PLAYBACK);
+}
+
+void ESFOutput::WriteStopPlayback()
+{
     uint8_t esfcmd = 0xff;
 
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        ESFFile<<"\t; The End\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        ASMFile<<"\t; The End\n";
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
@@ -353,14 +560,15 @@ void ESFOutput::SetDelay(uint8_t length)
     uint8_t esfcmd = 0xfe;
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,length,", $");
-        ESFFile<<"\t; Delay\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,length,", $");
+        ASMFile<<"\t; Delay\n";
         //fprintf(stderr, "DELAY %d\n", (int)length);
         return;
     }
-    ESFFile<<esfcmd<<length;
+    Put(esfcmd);
+    Put(length);
     return;
 }
 
@@ -370,29 +578,987 @@ void ESFOutput::SetShortDelay(uint8_t length)
     uint8_t esfcmd = 0xd0 | ((length-1)& 0x0f);
     if(ASMOut)
     {
-        ESFFile<<"\tdc.b ";
-        hexy(ESFFile,esfcmd,"$");
-        hexy(ESFFile,length,", $");
-        ESFFile<<"\t; Short delay\n";
+        ASMFile<<"\tdc.b ";
+        hexy(ASMFile,esfcmd,"$");
+        hexy(ASMFile,length,", $");
+        ASMFile<<"\t; Short delay\n";
         //fprintf(stderr, "DELAY %d\n", (int)length);
         return;
     }
-    ESFFile<<esfcmd;
+    Put(esfcmd);
     return;
 }
 
 /** @brief Inserts a comment containing pattern and row number to the ASM output */
 void ESFOutput::InsertPatRow(uint8_t pattern, uint8_t row)
+{
+    /* Only the ASM listing and the cost report use these */
+    if(ASMOut || CostBudget)
+        AddEvent(ESFEvent::PATTERN_ROW, 0, pattern, row);
+}
+
+void ESFOutput::WritePatRow(uint8_t pattern, uint8_t row)
 {
     if(ASMOut)
     {
-        ESFFile<<"; ";
-        hexy(ESFFile,pattern,"Pattern $");
-        ESFFile<<", Row "<<(int)row<<"; ";
-        ESFFile<<"\n";
+        ASMFile<<"; ";
+        hexy(ASMFile,pattern,"Pattern $");
+        ASMFile<<", Row "<<(int)row<<"; ";
+        ASMFile<<"\n";
         //fprintf(stderr, "DELAY %d\n", (int)length);
         return;
     }
     /* Do nothing if writing a binary */
     return;
 }
+
+/* Stream optimisation */
+
+static bool IsBarrier(const ESFEvent& event)
+{
+	switch(event.m_type)
+	{
+	case ESFEvent::DELAY:
+	case ESFEvent::SET_LOOP:
+	case ESFEvent::GOTO_LOOP:
+	case ESFEvent::STOP_PLAYBACK:
+	case ESFEvent::LOCK_CHANNEL:
+	case ESFEvent::SET_REGISTER_BANK0:
+	case ESFEvent::SET_REGISTER_BANK1:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** @brief Drops volume and frequency writes that are replaced on the same channel before any time
+    passes. A note on sets its own frequency, so it replaces a frequency write too. **/
+static void RemoveOverwrittenEvents(std::vector<ESFEvent>& events)
+{
+	std::vector<bool> dead(events.size(), false);
+
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		const ESFEvent& event = events[i];
+		if(event.m_type != ESFEvent::SET_VOLUME && event.m_type != ESFEvent::SET_FREQUENCY)
+			continue;
+
+		for(size_t j = i + 1; j < events.size() && !IsBarrier(events[j]); j++)
+		{
+			const ESFEvent& next = events[j];
+			if(next.m_type == ESFEvent::PATTERN_ROW || next.m_channel != event.m_channel)
+				continue;
+
+			if(next.m_type == event.m_type || (event.m_type == ESFEvent::SET_FREQUENCY && next.m_type == ESFEvent::NOTE_ON))
+				dead[i] = true;
+
+			//Any other command on the channel might depend on the write
+			break;
+		}
+	}
+
+	size_t out = 0;
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		if(!dead[i])
+			events[out++] = events[i];
+	}
+	events.resize(out);
+}
+
+static const int sNumShadowChannels = 16;
+static const int sUnknown = -1;
+
+/** What the stream has last set on a channel, sUnknown where that depends on the path taken.
+    For PSG4 the frequency is the noise mode, which note ons set as well. */
+struct ChannelShadow
+{
+	ChannelShadow() { Forget(); }
+
+	void Forget()
+	{
+		m_instrument = m_volume = m_params = m_frequency = sUnknown;
+	}
+
+	int m_instrument;
+	int m_volume;
+	int m_params;
+	int m_frequency;
+};
+
+/** Channel shadows for the whole stream */
+struct StreamShadow
+{
+	void Forget()
+	{
+		for(int i = 0; i < sNumShadowChannels; i++)
+			m_channels[i].Forget();
+	}
+
+	/** @brief Keeps only what is the same in both, for a point reached from two places */
+	void Intersect(const StreamShadow& other)
+	{
+		for(int i = 0; i < sNumShadowChannels; i++)
+		{
+			ChannelShadow& channel = m_channels[i];
+			const ChannelShadow& otherChannel = other.m_channels[i];
+
+			if(channel.m_instrument != otherChannel.m_instrument)
+				channel.m_instrument = sUnknown;
+			if(channel.m_volume != otherChannel.m_volume)
+				channel.m_volume = sUnknown;
+			if(channel.m_params != otherChannel.m_params)
+				channel.m_params = sUnknown;
+			if(channel.m_frequency != otherChannel.m_frequency)
+				channel.m_frequency = sUnknown;
+		}
+	}
+
+	/** @brief Updates the shadow for an event, returns true if the event changes nothing. Loop
+	    points are left to the caller. **/
+	bool Apply(const ESFEvent& event)
+	{
+		ChannelShadow& channel = m_channels[event.m_channel & (sNumShadowChannels - 1)];
+		int* known = NULL;
+
+		switch(event.m_type)
+		{
+		case ESFEvent::SET_INSTRUMENT:
+			//FM instruments reload the channel and reset its volume, so the same one again only
+			//changes nothing while the volume is still at the reset level. PSG ones are just an envelope.
+			if(ESFChannelTypes[event.m_channel] == CHANNEL_TYPE_FM)
+			{
+				if(channel.m_instrument == event.m_value && channel.m_volume == 0x7f)
+					return true;
+
+				channel.Forget();
+				channel.m_volume = 0x7f;
+			}
+			else if(channel.m_instrument == event.m_value)
+			{
+				return true;
+			}
+
+			channel.m_instrument = event.m_value;
+			return false;
+		case ESFEvent::SET_VOLUME:
+			known = &channel.m_volume;
+			break;
+		case ESFEvent::SET_PARAMS:
+			known = &channel.m_params;
+			break;
+		case ESFEvent::SET_FREQUENCY:
+			known = &channel.m_frequency;
+			break;
+		case ESFEvent::NOTE_ON:
+		case ESFEvent::NOTE_OFF:
+			if(event.m_channel == ESF_DAC)
+			{
+				//PCM playback takes over FM6
+				m_channels[ESF_FM6].Forget();
+			}
+			else if(event.m_type == ESFEvent::NOTE_ON)
+			{
+				//Echo looks up the note's frequency itself
+				channel.m_frequency = ESFChannelTypes[event.m_channel] == CHANNEL_TYPE_PSG4 ? event.m_value : sUnknown;
+			}
+			return false;
+		case ESFEvent::LOCK_CHANNEL:
+			channel.Forget();
+			return false;
+		case ESFEvent::GOTO_LOOP:
+		case ESFEvent::STOP_PLAYBACK:
+		case ESFEvent::SET_REGISTER_BANK0:
+		case ESFEvent::SET_REGISTER_BANK1:
+			Forget();
+			return false;
+		default:
+			return false;
+		}
+
+		if(*known == event.m_value)
+			return true;
+
+		*known = event.m_value;
+		return false;
+	}
+
+	ChannelShadow m_channels[sNumShadowChannels];
+};
+
+/** @brief Drops instrument, volume, params and frequency writes that set the value the channel
+    already has. At the loop point only what is the same on entry and at the loop end is known. **/
+static void RemoveRedundantEvents(std::vector<ESFEvent>& events)
+{
+	int numLoops = 0;
+	int numGotos = 0;
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		numLoops += events[i].m_type == ESFEvent::SET_LOOP;
+		numGotos += events[i].m_type == ESFEvent::GOTO_LOOP;
+	}
+
+	//Find what is known at the loop end, when entered from the loop point with nothing known
+	StreamShadow loopEnd;
+	loopEnd.Forget();
+	bool mergeLoop = numLoops == 1 && numGotos == 1;
+	for(size_t i = 0; i < events.size() && mergeLoop; i++)
+	{
+		if(events[i].m_type == ESFEvent::GOTO_LOOP)
+			break;
+		if(events[i].m_type == ESFEvent::SET_LOOP)
+			loopEnd.Forget();
+		else
+			loopEnd.Apply(events[i]);
+	}
+
+	StreamShadow shadow;
+	size_t out = 0;
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		const ESFEvent& event = events[i];
+
+		if(event.m_type == ESFEvent::SET_LOOP)
+		{
+			if(mergeLoop)
+				shadow.Intersect(loopEnd);
+			else
+				shadow.Forget();
+		}
+		else if(shadow.Apply(event))
+		{
+			continue;
+		}
+
+		events[out++] = event;
+	}
+	events.resize(out);
+}
+
+/** @brief Joins delays that only have listing comments between them */
+static void MergeDelays(std::vector<ESFEvent>& events)
+{
+	size_t out = 0;
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		const ESFEvent& event = events[i];
+
+		if(event.m_type == ESFEvent::DELAY)
+		{
+			size_t prev = out;
+			while(prev > 0 && events[prev - 1].m_type == ESFEvent::PATTERN_ROW)
+				prev--;
+
+			if(prev > 0 && events[prev - 1].m_type == ESFEvent::DELAY)
+			{
+				events[prev - 1].m_value2 += event.m_value2;
+				continue;
+			}
+		}
+
+		events[out++] = event;
+	}
+	events.resize(out);
+}
+
+/** @brief Peephole pass over the recorded events. Only commands that can't be heard are removed,
+    every remaining command keeps its timing. **/
+void OptimizeEvents(std::vector<ESFEvent>& events)
+{
+	RemoveOverwrittenEvents(events);
+	RemoveRedundantEvents(events);
+	MergeDelays(events);
+}
+
+/** What a replayed channel has been set to, in ESF terms. FM instrument loads reset the
+    attenuation, PSG4 note ons set the noise mode, like StreamShadow assumes. */
+struct ReplayChannel
+{
+	int32_t m_instrument;
+	int32_t m_volume;
+	int32_t m_params;
+	int32_t m_frequency;
+};
+
+/** @brief Adds a channel's state to a replay trace */
+static void TraceChannel(const ReplayChannel& channel, std::vector<int32_t>& trace)
+{
+	trace.push_back(channel.m_instrument);
+	trace.push_back(channel.m_volume);
+	trace.push_back(channel.m_params);
+	trace.push_back(channel.m_frequency);
+}
+
+/** @brief Plays a binary ESF stream through a model of Echo's channel state and records what can be
+    heard: the state of the channels whenever time moves on and the channel's state at every note on
+    and off, lock and register write. The loop is played twice, so state carried round it is checked
+    too. Streams that differ only by commands that change nothing give the same trace. Returns true
+    if the stream can't be read. **/
+bool ReplayESF(const std::vector<uint8_t>& esf, std::vector<int32_t>& trace)
+{
+	ReplayChannel channels[sNumShadowChannels];
+	for(int i = 0; i < sNumShadowChannels; i++)
+		channels[i].m_instrument = channels[i].m_volume = channels[i].m_params = channels[i].m_frequency = sUnknown;
+
+	ReplayChannel heard[sNumShadowChannels];
+	memcpy(heard, channels, sizeof(heard));
+
+	trace.clear();
+
+	uint32_t tick = 0;
+	size_t loop = 0;
+	bool hasLoop = false;
+	bool looped = false;
+	size_t pos = 0;
+	while(pos < esf.size())
+	{
+		uint8_t cmd = esf[pos];
+		uint8_t chan = cmd & 0x0f;
+		ReplayChannel& channel = channels[chan];
+		size_t size = 1;
+		uint32_t ticks = 0;
+
+		switch(cmd >> 4)
+		{
+		case 0x0:
+		case 0x1:
+			size = cmd < 0x10 ? 2 : 1;
+			if(pos + size > esf.size())
+				return 1;
+
+			if(chan == ESF_DAC)
+			{
+				//PCM playback takes over FM6
+				channels[ESF_FM6].m_instrument = channels[ESF_FM6].m_volume = channels[ESF_FM6].m_params = channels[ESF_FM6].m_frequency = sUnknown - 1;
+			}
+			else if(cmd < 0x10)
+			{
+				channel.m_frequency = ESFChannelTypes[chan] == CHANNEL_TYPE_PSG4 ? esf[pos + 1] : sUnknown - 1;
+			}
+
+			trace.push_back(tick);
+			trace.push_back(cmd);
+			trace.push_back(size > 1 ? esf[pos + 1] : 0);
+			TraceChannel(channel, trace);
+			break;
+		case 0x2:
+			size = 2;
+			if(pos + size > esf.size())
+				return 1;
+			channel.m_volume = esf[pos + 1];
+			break;
+		case 0x3:
+			size = ESFChannelTypes[chan] == CHANNEL_TYPE_PSG4 ? 2 : 3;
+			if(pos + size > esf.size())
+				return 1;
+			channel.m_frequency = size == 2 ? esf[pos + 1] : esf[pos + 1] << 8 | esf[pos + 2];
+			break;
+		case 0x4:
+			size = 2;
+			if(pos + size > esf.size())
+				return 1;
+			channel.m_instrument = esf[pos + 1];
+			if(ESFChannelTypes[chan] == CHANNEL_TYPE_FM)
+				channel.m_volume = 0;
+			break;
+		case 0xd:
+			ticks = chan + 1;
+			break;
+		case 0xe:
+			channel.m_instrument = channel.m_volume = channel.m_params = channel.m_frequency = sUnknown - 1;
+			trace.push_back(tick);
+			trace.push_back(cmd);
+			break;
+		case 0xf:
+			if(cmd < 0xf8)
+			{
+				size = 2;
+				if(pos + size > esf.size())
+					return 1;
+				channel.m_params = esf[pos + 1];
+			}
+			else if(cmd == 0xf8 || cmd == 0xf9)
+			{
+				size = 3;
+				if(pos + size > esf.size())
+					return 1;
+				trace.push_back(tick);
+				trace.push_back(cmd);
+				trace.push_back(esf[pos + 1]);
+				trace.push_back(esf[pos + 2]);
+			}
+			else if(cmd == 0xfc)
+			{
+				if(!hasLoop || looped)
+					return 0;
+
+				looped = true;
+				pos = loop;
+				continue;
+			}
+			else if(cmd == 0xfd)
+			{
+				hasLoop = true;
+				loop = pos + 1;
+			}
+			else if(cmd == 0xfe)
+			{
+				size = 2;
+				if(pos + size > esf.size())
+					return 1;
+				ticks = esf[pos + 1] ? esf[pos + 1] : 256;
+			}
+			else if(cmd == 0xff)
+			{
+				return 0;
+			}
+			else
+			{
+				return 1;
+			}
+			break;
+		default:
+			return 1;
+		}
+
+		//Only what the channels are set to while time passes can be heard
+		if(ticks && memcmp(heard, channels, sizeof(heard)))
+		{
+			trace.push_back(tick);
+			for(int i = 0; i < sNumShadowChannels; i++)
+				TraceChannel(channels[i], trace);
+			memcpy(heard, channels, sizeof(heard));
+		}
+
+		tick += ticks;
+		pos += size;
+	}
+	return 0;
+}
+
+/* Repeated sequence estimate */
+
+static const uint32_t sCallSize = 3;            // command and a 16-bit offset
+static const uint32_t sReturnSize = 1;
+
+/** @brief Size of an event once written, must match the Write functions */
+static uint32_t GetEventSize(const ESFEvent& event)
+{
+	switch(event.m_type)
+	{
+	case ESFEvent::NOTE_ON:
+	case ESFEvent::SET_VOLUME:
+	case ESFEvent::SET_INSTRUMENT:
+	case ESFEvent::SET_PARAMS:
+		return 2;
+	case ESFEvent::NOTE_OFF:
+	case ESFEvent::LOCK_CHANNEL:
+	case ESFEvent::GOTO_LOOP:
+	case ESFEvent::SET_LOOP:
+	case ESFEvent::STOP_PLAYBACK:
+		return 1;
+	case ESFEvent::SET_FREQUENCY:
+		switch(ESFChannelTypes[event.m_channel])
+		{
+		case CHANNEL_TYPE_FM:
+		case CHANNEL_TYPE_PSG:
+			return 3;
+		case CHANNEL_TYPE_PSG4:
+			return 2;
+		default:
+			return 0;
+		}
+	case ESFEvent::SET_REGISTER_BANK0:
+	case ESFEvent::SET_REGISTER_BANK1:
+		return 3;
+	case ESFEvent::DELAY:
+	{
+		uint32_t rest = event.m_value2 & 0xff;
+		uint32_t size = (event.m_value2 >> 8) * 2;
+		if(rest)
+			size += (rest <= 16 && ExCommands) ? 1 : 2;
+		return size;
+	}
+	default:
+		return 0;
+	}
+}
+
+/** @brief Loop points stay in the main stream, everything else may move into a subroutine */
+static bool IsMovable(const ESFEvent& event)
+{
+	switch(event.m_type)
+	{
+	case ESFEvent::SET_LOOP:
+	case ESFEvent::GOTO_LOOP:
+	case ESFEvent::STOP_PLAYBACK:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/** @brief Suffix array by prefix doubling */
+static void BuildSuffixArray(const std::vector<int>& ids, std::vector<int>& sa)
+{
+	const int n = ids.size();
+	std::vector<int> rank(ids), next(n);
+
+	sa.resize(n);
+	for(int i = 0; i < n; i++)
+		sa[i] = i;
+
+	for(int k = 1; ; k *= 2)
+	{
+		struct Compare
+		{
+			const std::vector<int>& m_rank;
+			int m_k;
+			int m_n;
+			Compare(const std::vector<int>& rank, int k, int n) : m_rank(rank), m_k(k), m_n(n) {}
+			bool operator()(int a, int b) const
+			{
+				if(m_rank[a] != m_rank[b])
+					return m_rank[a] < m_rank[b];
+				int ra = a + m_k < m_n ? m_rank[a + m_k] : -1;
+				int rb = b + m_k < m_n ? m_rank[b + m_k] : -1;
+				return ra < rb;
+			}
+		} compare(rank, k, n);
+
+		std::sort(sa.begin(), sa.end(), compare);
+
+		next[sa[0]] = 0;
+		for(int i = 1; i < n; i++)
+			next[sa[i]] = next[sa[i - 1]] + (compare(sa[i - 1], sa[i]) ? 1 : 0);
+		rank.swap(next);
+
+		if(rank[sa[n - 1]] == n - 1)
+			break;
+	}
+}
+
+/** A run of tokens shared by the suffixes sa[m_first..m_last) */
+struct RepeatCandidate
+{
+	uint32_t m_saving;          // if no copy overlaps another repeat
+	int m_first;
+	int m_last;
+	int m_length;
+
+	bool operator<(const RepeatCandidate& other) const
+	{
+		return m_saving > other.m_saving;
+	}
+};
+
+/** @brief Estimates how many bytes would be saved if repeated runs of commands were written once
+    as a subroutine and called from each place they occur. Echo has no call command, so the stream
+    itself is never changed. The suffix array is built once, then repeats are taken greedily by
+    saving, skipping copies that overlap a repeat taken before. **/
+uint32_t GetRepeatSavings(const std::vector<ESFEvent>& events)
+{
+	//Tokens are the written commands, listing comments are skipped
+	std::vector<int> ids;
+	std::vector<uint32_t> offsets(1, 0);
+	std::map<std::vector<uint32_t>, int> idMap;
+	int nextUnique = -1;
+
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		const ESFEvent& event = events[i];
+		if(event.m_type == ESFEvent::PATTERN_ROW)
+			continue;
+
+		int id;
+		if(IsMovable(event))
+		{
+			std::vector<uint32_t> key(4);
+			key[0] = event.m_type;
+			key[1] = event.m_channel;
+			key[2] = event.m_value;
+			key[3] = event.m_value2;
+			std::map<std::vector<uint32_t>, int>::iterator it = idMap.find(key);
+			if(it == idMap.end())
+				it = idMap.insert(std::make_pair(key, (int)idMap.size())).first;
+			id = it->second;
+		}
+		else
+		{
+			//Never matches anything, so no repeat can include it
+			id = nextUnique--;
+		}
+
+		ids.push_back(id);
+		offsets.push_back(offsets.back() + GetEventSize(event));
+	}
+
+	const int n = ids.size();
+	if(n < 2)
+		return 0;
+
+	std::vector<int> sa, rank(n), lcp(n + 1, 0);
+	BuildSuffixArray(ids, sa);
+
+	//Kasai, lcp[i] is shared by the suffixes at sa[i - 1] and sa[i]
+	for(int i = 0; i < n; i++)
+		rank[sa[i]] = i;
+	for(int i = 0, h = 0; i < n; i++)
+	{
+		if(rank[i] == 0)
+		{
+			h = 0;
+			continue;
+		}
+		int j = sa[rank[i] - 1];
+		while(i + h < n && j + h < n && ids[i + h] == ids[j + h])
+			h++;
+		lcp[rank[i]] = h;
+		if(h > 0)
+			h--;
+	}
+
+	//Every lcp interval is a run that occurs once per suffix in it
+	std::vector<RepeatCandidate> candidates;
+	std::vector<std::pair<int, int> > stack;   // shared length, first suffix
+	stack.push_back(std::make_pair(0, 0));
+
+	for(int i = 1; i <= n; i++)
+	{
+		int lb = i - 1;
+		while(lcp[i] < stack.back().first)
+		{
+			int length = stack.back().first;
+			lb = stack.back().second;
+			stack.pop_back();
+
+			int first = sa[lb];
+			uint32_t size = offsets[first + length] - offsets[first];
+			uint32_t count = i - lb;
+			if(size > sCallSize && count * (size - sCallSize) > size + sReturnSize)
+			{
+				RepeatCandidate candidate;
+				candidate.m_saving = count * (size - sCallSize) - size - sReturnSize;
+				candidate.m_first = lb;
+				candidate.m_last = i;
+				candidate.m_length = length;
+				candidates.push_back(candidate);
+			}
+		}
+		if(i < n && lcp[i] > stack.back().first)
+			stack.push_back(std::make_pair(lcp[i], lb));
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end());
+
+	std::vector<bool> used(n, false);
+	std::vector<int> starts;
+	uint32_t totalSaving = 0;
+
+	for(size_t c = 0; c < candidates.size(); c++)
+	{
+		const RepeatCandidate& candidate = candidates[c];
+		const int length = candidate.m_length;
+
+		starts.assign(sa.begin() + candidate.m_first, sa.begin() + candidate.m_last);
+		std::sort(starts.begin(), starts.end());
+
+		//Copies can't overlap each other or a repeat already taken, keep the earliest ones
+		int end = 0;
+		uint32_t count = 0;
+		for(size_t j = 0; j < starts.size(); j++)
+		{
+			if(starts[j] < end)
+				continue;
+
+			int k = 0;
+			while(k < length && !used[starts[j] + k])
+				k++;
+			if(k < length)
+				continue;
+
+			starts[count++] = starts[j];
+			end = starts[j] + length;
+		}
+
+		uint32_t size = offsets[starts[0] + length] - offsets[starts[0]];
+		if(count * (size - sCallSize) <= size + sReturnSize)
+			continue;
+
+		totalSaving += count * (size - sCallSize) - size - sReturnSize;
+		for(uint32_t j = 0; j < count; j++)
+			std::fill(used.begin() + starts[j], used.begin() + starts[j] + length, true);
+	}
+
+	return totalSaving;
+}
+
+/* Cycle cost estimate */
+
+static const uint32_t sDispatchCycles = 60;     // Z80 cycles to fetch a command and jump to its handler
+static const uint32_t sYMWriteCycles = 84;      // one YM2612 write, including waiting for the chip to be ready
+static const uint32_t sPSGWriteCycles = 20;     // one PSG write, the PSG never makes the Z80 wait
+static const int sNumReportedTicks = 10;
+
+/** Work done by Echo's handler for one command. The figures are estimates, close enough to compare
+    ticks and streams but not cycle exact. */
+struct CommandCost
+{
+	uint32_t m_z80Cycles;       // handler work besides the port writes
+	uint32_t m_ymWrites;
+	uint32_t m_psgWrites;
+};
+
+/** Names for the report, in ESFEvent::Type order */
+static const char* sCommandNames[] =
+{
+	"Note on", "Note off", "Volume", "Frequency", "Instrument", "Lock", "Params", "Register bank 0",
+	"Register bank 1", "Goto loop", "Set loop", "Stop", "Delay", "Pattern row",
+};
+
+static CommandCost GetCommandCost(const ESFEvent& event)
+{
+	CommandCost cost = { 20, 0, 0 };
+	ChannelType type = ESFChannelTypes[event.m_channel];
+
+	switch(event.m_type)
+	{
+	case ESFEvent::NOTE_ON:
+		switch(type)
+		{
+		case CHANNEL_TYPE_FM:
+			//Key off, frequency high and low, key on
+			cost.m_z80Cycles = 180;
+			cost.m_ymWrites = 4;
+			break;
+		case CHANNEL_TYPE_PSG:
+			//Frequency in two writes, then the envelope's first volume
+			cost.m_z80Cycles = 150;
+			cost.m_psgWrites = 3;
+			break;
+		case CHANNEL_TYPE_PSG4:
+			cost.m_z80Cycles = 120;
+			cost.m_psgWrites = 2;
+			break;
+		default:
+			//Sample lookup and switching FM6 to the DAC, the streaming itself isn't counted
+			cost.m_z80Cycles = 250;
+			cost.m_ymWrites = 1;
+			break;
+		}
+		break;
+	case ESFEvent::NOTE_OFF:
+		cost.m_z80Cycles = 40;
+		if(type == CHANNEL_TYPE_PSG || type == CHANNEL_TYPE_PSG4)
+			cost.m_psgWrites = 1;
+		else
+			cost.m_ymWrites = 1;
+		break;
+	case ESFEvent::SET_VOLUME:
+		if(type == CHANNEL_TYPE_PSG || type == CHANNEL_TYPE_PSG4)
+		{
+			cost.m_z80Cycles = 40;
+			cost.m_psgWrites = 1;
+		}
+		else
+		{
+			//Total level of every operator, scaled for the ones the algorithm outputs
+			cost.m_z80Cycles = 200;
+			cost.m_ymWrites = 4;
+		}
+		break;
+	case ESFEvent::SET_FREQUENCY:
+		cost.m_z80Cycles = 60;
+		if(type == CHANNEL_TYPE_FM)
+			cost.m_ymWrites = 2;
+		else if(type == CHANNEL_TYPE_PSG)
+			cost.m_psgWrites = 2;
+		else if(type == CHANNEL_TYPE_PSG4)
+			cost.m_psgWrites = 1;
+		break;
+	case ESFEvent::SET_INSTRUMENT:
+		if(type == CHANNEL_TYPE_PSG || type == CHANNEL_TYPE_PSG4)
+		{
+			//Only points the channel at the envelope
+			cost.m_z80Cycles = 100;
+		}
+		else
+		{
+			//Read from ROM through the bank window, 7 registers per operator plus algorithm/feedback
+			cost.m_z80Cycles = 600;
+			cost.m_ymWrites = 29;
+		}
+		break;
+	case ESFEvent::SET_PARAMS:
+	case ESFEvent::SET_REGISTER_BANK0:
+	case ESFEvent::SET_REGISTER_BANK1:
+		cost.m_z80Cycles = 40;
+		cost.m_ymWrites = 1;
+		break;
+	case ESFEvent::LOCK_CHANNEL:
+		cost.m_z80Cycles = 40;
+		break;
+	default:
+		break;
+	}
+
+	return cost;
+}
+
+static uint32_t GetTotalCycles(const CommandCost& cost, uint32_t numCommands)
+{
+	return numCommands * sDispatchCycles + cost.m_z80Cycles + cost.m_ymWrites * sYMWriteCycles + cost.m_psgWrites * sPSGWriteCycles;
+}
+
+/** Everything run on one tick, with the order position and row it belongs to */
+struct TickCost
+{
+	uint32_t m_tick;
+	uint32_t m_numCommands;
+	uint32_t m_cycles;
+	CommandCost m_cost;
+	uint8_t m_pattern;
+	uint8_t m_row;
+	uint32_t m_rowTick;         // ticks since the row started
+
+	bool operator<(const TickCost& other) const
+	{
+		if(m_cycles != other.m_cycles)
+			return m_cycles > other.m_cycles;
+		return m_tick < other.m_tick;
+	}
+};
+
+/** @brief Estimates the Z80 time and chip writes each tick of the stream takes in Echo, and lists the
+    busiest ticks by pattern and row. Ticks over tickBudget Z80 cycles are flagged. Rows are only
+    known from PATTERN_ROW events, so they must have been recorded. **/
+std::string GetCostReport(const std::vector<ESFEvent>& events, uint32_t tickBudget)
+{
+	const int numTypes = sizeof(sCommandNames) / sizeof(sCommandNames[0]);
+
+	CommandCost typeCosts[numTypes];
+	uint32_t typeCounts[numTypes];
+	uint32_t typeCycles[numTypes];
+	memset(typeCosts, 0, sizeof(typeCosts));
+	memset(typeCounts, 0, sizeof(typeCounts));
+	memset(typeCycles, 0, sizeof(typeCycles));
+
+	std::vector<TickCost> ticks;
+	uint32_t tick = 0;
+	uint32_t rowStart = 0;
+	bool rowPending = false;
+	uint8_t pattern = 0;
+	uint8_t row = 0;
+
+	for(size_t i = 0; i < events.size(); i++)
+	{
+		const ESFEvent& event = events[i];
+
+		if(event.m_type == ESFEvent::PATTERN_ROW)
+		{
+			//The row starts after the delay that usually follows, or right away if a command does
+			pattern = event.m_value;
+			row = event.m_value2;
+			rowPending = true;
+			continue;
+		}
+
+		if(event.m_type >= numTypes)
+			continue;
+
+		CommandCost cost = GetCommandCost(event);
+		CommandCost& typeCost = typeCosts[event.m_type];
+		typeCost.m_ymWrites += cost.m_ymWrites;
+		typeCost.m_psgWrites += cost.m_psgWrites;
+		typeCounts[event.m_type]++;
+		typeCycles[event.m_type] += GetTotalCycles(cost, 1);
+
+		//Delays only move time on
+		if(event.m_type == ESFEvent::DELAY)
+		{
+			tick += event.m_value2;
+			if(rowPending)
+			{
+				rowStart = tick;
+				rowPending = false;
+			}
+			continue;
+		}
+
+		if(rowPending)
+		{
+			rowStart = tick;
+			rowPending = false;
+		}
+
+		if(ticks.empty() || ticks.back().m_tick != tick)
+		{
+			TickCost newTick;
+			memset(&newTick, 0, sizeof(newTick));
+			newTick.m_tick = tick;
+			newTick.m_pattern = pattern;
+			newTick.m_row = row;
+			newTick.m_rowTick = tick - rowStart;
+			ticks.push_back(newTick);
+		}
+
+		TickCost& tickCost = ticks.back();
+		tickCost.m_numCommands++;
+		tickCost.m_cost.m_z80Cycles += cost.m_z80Cycles;
+		tickCost.m_cost.m_ymWrites += cost.m_ymWrites;
+		tickCost.m_cost.m_psgWrites += cost.m_psgWrites;
+		tickCost.m_cycles = GetTotalCycles(tickCost.m_cost, tickCost.m_numCommands);
+	}
+
+	std::string report;
+	char line[256];
+
+	report += "Estimated Echo cost per command type (PCM streaming not included):\n";
+	for(int i = 0; i < numTypes; i++)
+	{
+		if(!typeCounts[i])
+			continue;
+
+		snprintf(line, sizeof(line), "  %-16s %7u commands %7u YM2612 writes %7u PSG writes %9u Z80 cycles\n",
+			sCommandNames[i], typeCounts[i], typeCosts[i].m_ymWrites, typeCosts[i].m_psgWrites, typeCycles[i]);
+		report += line;
+	}
+
+	uint32_t numOver = 0;
+	uint64_t totalCycles = 0;
+	for(size_t i = 0; i < ticks.size(); i++)
+	{
+		totalCycles += ticks[i].m_cycles;
+		numOver += ticks[i].m_cycles > tickBudget;
+	}
+
+	if(ticks.empty())
+	{
+		report += "No ticks run any commands.\n";
+		return report;
+	}
+
+	snprintf(line, sizeof(line), "%u of %u ticks run commands, %llu Z80 cycles on average\n",
+		(uint32_t)ticks.size(), tick + 1, (unsigned long long)(totalCycles / ticks.size()));
+	report += line;
+
+	//Only the busiest ones need sorting
+	size_t numReported = std::min(ticks.size(), (size_t)sNumReportedTicks);
+	std::partial_sort(ticks.begin(), ticks.begin() + numReported, ticks.end());
+
+	snprintf(line, sizeof(line), "Busiest ticks, budget %u Z80 cycles:\n", tickBudget);
+	report += line;
+	for(size_t i = 0; i < numReported; i++)
+	{
+		const TickCost& busy = ticks[i];
+		snprintf(line, sizeof(line), "  Tick %6u pattern $%02x row %3u+%u: %3u commands %3u YM2612 writes %3u PSG writes %6u Z80 cycles%s\n",
+			busy.m_tick, busy.m_pattern, busy.m_row, busy.m_rowTick, busy.m_numCommands, busy.m_cost.m_ymWrites, busy.m_cost.m_psgWrites,
+			busy.m_cycles, busy.m_cycles > tickBudget ? " OVER BUDGET" : "");
+		report += line;
+	}
+
+	snprintf(line, sizeof(line), "%u ticks over budget\n", numOver);
+	report += line;
+
+	return report;
+}
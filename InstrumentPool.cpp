@@ -0,0 +1,113 @@
+#include "dmf2esf.h"
+
+using namespace std;
+
+TrackTurn::TrackTurn()
+{
+	m_nextTrack = 0;
+}
+
+/** @brief Waits until every earlier track has ended its turn. Every track must take its turn,
+    or the ones after it wait forever. **/
+void TrackTurn::Begin(int trackIdx)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while(m_nextTrack != trackIdx)
+	{
+		m_turn.wait(lock);
+	}
+}
+
+void TrackTurn::End(int trackIdx)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_nextTrack = trackIdx + 1;
+	}
+	m_turn.notify_all();
+}
+
+InstrumentOffsets::InstrumentOffsets(int firstIndex)
+{
+	m_nextIndex = firstIndex;
+}
+
+/** @brief Waits until every earlier track has claimed its offset, then returns this track's and
+    moves on by its count **/
+int InstrumentOffsets::Claim(int trackIdx, int count)
+{
+	m_turn.Begin(trackIdx);
+	int offset = m_nextIndex;
+	m_nextIndex += count;
+	m_turn.End(trackIdx);
+	return offset;
+}
+
+/** @brief Gives up the turn of a track that failed before it knew its count */
+void InstrumentOffsets::Skip(int trackIdx)
+{
+	Claim(trackIdx, 0);
+}
+
+InstrumentPool::InstrumentPool(int firstIndex)
+{
+	m_nextIndex = firstIndex;
+	m_numAdded = 0;
+}
+
+/** @brief Waits until every earlier track has added its instruments, so the indices handed out
+    only depend on track order and not on which job gets there first **/
+void InstrumentPool::BeginTrack(int trackIdx)
+{
+	m_turn.Begin(trackIdx);
+}
+
+void InstrumentPool::EndTrack(int trackIdx)
+{
+	m_turn.End(trackIdx);
+}
+
+/** @brief Finds or adds an instrument or sample, returns true if out of ESF indices. Only call
+    between BeginTrack and EndTrack. **/
+bool InstrumentPool::Add(const OutputFile& file, uint8_t& index, bool& isNew)
+{
+	//Key on the file type as well, an .eif and an .ewf are never interchangeable
+	std::string key = file.m_name.substr(file.m_name.rfind('.') + 1);
+	key.push_back('\0');
+	key.append(file.m_data.begin(), file.m_data.end());
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_numAdded++;
+
+	std::unordered_map<std::string, uint8_t>::iterator it = m_entries.find(key);
+	if(it != m_entries.end())
+	{
+		index = it->second;
+		isNew = false;
+		return 0;
+	}
+
+	if(m_nextIndex > 0xff)
+	{
+		fprintf(stderr, "Too many unique instruments and samples in batch, ESF supports 256.\n");
+		return 1;
+	}
+
+	index = m_nextIndex++;
+	isNew = true;
+	m_entries[key] = index;
+	return 0;
+}
+
+int InstrumentPool::GetNumUnique()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+int InstrumentPool::GetNumAdded()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_numAdded;
+}
@@ -0,0 +1,165 @@
+#include "dmf2esf.h"
+
+using namespace std;
+
+static const double sPi = 3.14159265358979323846;
+
+static int GreatestCommonDivisor(int a, int b)
+{
+	while(b)
+	{
+		int rest = a % b;
+		a = b;
+		b = rest;
+	}
+	return a;
+}
+
+/** @brief The ratio is reduced to outputRate / inputRate = numPhases / step, so output n sits
+    step * n / numPhases input samples in and the phases repeat every numPhases outputs. **/
+void PolyphaseResampler::SetRates(int inputRate, int outputRate)
+{
+	int divisor = GreatestCommonDivisor(inputRate, outputRate);
+	m_numPhases = outputRate / divisor;
+	m_step = inputRate / divisor;
+}
+
+/** @brief Builds one windowed sinc filter of numTaps per output phase **/
+PolyphaseResampler::PolyphaseResampler(int inputRate, int outputRate, int numTaps)
+{
+	SetRates(inputRate, outputRate);
+	m_numTaps = numTaps;
+	m_center = m_numTaps / 2 - 1;
+	m_coeffs.resize(m_numPhases * m_numTaps);
+
+	//Cut off a little under the lower Nyquist frequency, in cycles per input sample
+	double cutoff = 0.45 * std::min(1.0, (double)outputRate / inputRate);
+
+	for(int phase = 0; phase < m_numPhases; phase++)
+	{
+		float* coeffs = &m_coeffs[phase * m_numTaps];
+		double sum = 0.0;
+
+		for(int tap = 0; tap < m_numTaps; tap++)
+		{
+			//Distance from the output position to this tap's input sample
+			double t = tap - m_center - (double)phase / m_numPhases;
+			double x = 2.0 * cutoff * t;
+			double sinc = x == 0.0 ? 1.0 : sin(sPi * x) / (sPi * x);
+
+			//Blackman window over the filter span
+			double w = (t + m_center + 1) / (m_numTaps + 1);
+			double window = 0.42 - 0.5 * cos(2.0 * sPi * w) + 0.08 * cos(4.0 * sPi * w);
+
+			double value = 2.0 * cutoff * sinc * window;
+			coeffs[tap] = value;
+			sum += value;
+		}
+
+		//Unity gain at DC for every phase
+		for(int tap = 0; tap < m_numTaps; tap++)
+			coeffs[tap] /= sum;
+	}
+}
+
+/** @brief Samples a libsamplerate half filter table at each phase's tap positions, the way its
+    sinc converters do per output sample: 12 bit fixed point table positions, linear interpolation
+    between entries, the filter stretched by the ratio when downsampling. The bank then gives the
+    same filter without redoing that work for every output. **/
+PolyphaseResampler::PolyphaseResampler(int inputRate, int outputRate, const float* table, int tableHalfLen, int tableIncrement)
+{
+	const int shiftBits = 12;
+	const int64_t one = (int64_t)1 << shiftBits;
+
+	SetRates(inputRate, outputRate);
+
+	double floatIncrement = tableIncrement * std::min(1.0, (double)outputRate / inputRate);
+	double scale = floatIncrement / tableIncrement;
+	int64_t increment = lrint(floatIncrement * one);
+	int64_t maxIndex = (int64_t)tableHalfLen << shiftBits;
+
+	//Taps to the left reach maxIndex / increment samples back, those to the right one further
+	m_center = maxIndex / increment;
+	m_numTaps = m_center + 1 + (maxIndex + increment) / increment;
+	m_coeffs.assign(m_numPhases * m_numTaps, 0.0f);
+
+	for(int phase = 0; phase < m_numPhases; phase++)
+	{
+		float* coeffs = &m_coeffs[phase * m_numTaps];
+		int64_t start = lrint((double)phase / m_numPhases * floatIncrement * one);
+
+		for(int tap = 0; tap < m_numTaps; tap++)
+		{
+			//Table position of this tap, the centre tap and those before it start at start
+			int offset = tap - m_center;
+			int64_t index = offset <= 0 ? start - offset * increment : offset * increment - start;
+
+			if(index < (offset <= 0 ? 0 : 1) || index > maxIndex)
+				continue;
+
+			int entry = index >> shiftBits;
+			double fraction = (double)(index & (one - 1)) / one;
+			coeffs[tap] = scale * (table[entry] + fraction * (table[entry + 1] - table[entry]));
+		}
+	}
+}
+
+/** @brief Number of output samples for numInput input samples **/
+uint32_t PolyphaseResampler::GetOutputSize(uint32_t numInput) const
+{
+	return ((uint64_t)numInput * m_numPhases + m_step - 1) / m_step;
+}
+
+/** @brief Four running sums so the compiler can keep them in one vector register **/
+static inline float DotProduct(const float* coeffs, const float* input, int count)
+{
+	float sums[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+	int tap = 0;
+	for(; tap + 4 <= count; tap += 4)
+	{
+		sums[0] += coeffs[tap + 0] * input[tap + 0];
+		sums[1] += coeffs[tap + 1] * input[tap + 1];
+		sums[2] += coeffs[tap + 2] * input[tap + 2];
+		sums[3] += coeffs[tap + 3] * input[tap + 3];
+	}
+
+	for(; tap < count; tap++)
+		sums[0] += coeffs[tap] * input[tap];
+
+	return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+/** @brief First input sample read for output outputIdx, negative near the start **/
+int64_t PolyphaseResampler::GetFirstInput(uint32_t outputIdx) const
+{
+	return (int64_t)((uint64_t)outputIdx * m_step / m_numPhases) - m_center;
+}
+
+/** @brief Input samples read for numOutput outputs from firstOutput **/
+uint32_t PolyphaseResampler::GetInputSpan(uint32_t firstOutput, uint32_t numOutput) const
+{
+	return GetFirstInput(firstOutput + numOutput - 1) - GetFirstInput(firstOutput) + m_numTaps;
+}
+
+/** @brief Upper bound of GetInputSpan() for numOutput outputs, wherever they start **/
+uint32_t PolyphaseResampler::GetMaxInputSpan(uint32_t numOutput) const
+{
+	return (uint64_t)numOutput * m_step / m_numPhases + 1 + m_numTaps;
+}
+
+/** @brief Filters numOutput outputs starting at firstOutput. input holds GetInputSpan() samples
+    from GetFirstInput(firstOutput) on, the caller pads it with silence outside the sample. **/
+void PolyphaseResampler::Process(const float* input, uint32_t firstOutput, uint32_t numOutput, float* output) const
+{
+	int64_t base = GetFirstInput(firstOutput);
+
+	uint64_t position = (uint64_t)firstOutput * m_step;
+	for(uint32_t i = 0; i < numOutput; i++, position += m_step)
+	{
+		int64_t first = (int64_t)(position / m_numPhases) - m_center;
+		const float* coeffs = &m_coeffs[(position % m_numPhases) * m_numTaps];
+
+		output[i] = DotProduct(coeffs, input + (first - base), m_numTaps);
+	}
+}
@@ -20,15 +20,25 @@ Echo ESF documentation
 #define MAJORVER 0
 #define MINORVER 1
 
+/* Bump this whenever a change alters the ESF, EIF or EWF written for the same input, cache
+   entries made by any other version are never reused */
+#define CONVERTER_VERSION 1
+
     #include <iostream>
     #include <iomanip>
     #include <fstream>
+    #include <sstream>
     #include <vector>
     #include <stdio.h>
+    #include <stdlib.h>
     #include <math.h>
     #include <algorithm>
     #include <cstring>
 	#include <set>
+	#include <map>
+	#include <unordered_map>
+	#include <mutex>
+	#include <condition_variable>
 
     #define MINIZ_HEADER_FILE_ONLY
     #include "miniz.c"
@@ -102,11 +112,13 @@ enum EffectMode
     EFFECT_SCHEDULE,// porta note
 };
 
-enum EffectStage
+// When a row's effect is applied. Per-tick work is done by active effects, see sTickEffects
+enum EffectPhase
 {
-	EFFECT_STAGE_OFF,
-	EFFECT_STAGE_INITIALISE,
-	EFFECT_STAGE_CONTINUE
+	EFFECT_PHASE_PRE_NOTE,  // before the row's note, state the note on depends on
+	EFFECT_PHASE_NOTE_ON,   // only on rows with a note, changes how it is played
+	EFFECT_PHASE_ROW,       // after the note
+	EFFECT_PHASE_COUNT
 };
 
 enum EffectType
@@ -134,6 +146,7 @@ enum EffectType
 	EFFECT_TYPE_SET_VIBRATO_MODE = 0xe3, // Vibrato mode
 	EFFECT_TYPE_SET_FINE_VIBRATO = 0xe4, // Fine vibrato depth
 	EFFECT_TYPE_NOTE_CUT = 0xec, // Note cut
+	EFFECT_TYPE_NOTE_DELAY = 0xed, // Note delay
 	EFFECT_TYPE_JUMP = 0x0b, // Position jump
 	EFFECT_TYPE_BREAK = 0x0d, // Pattern break
 };
@@ -219,30 +232,74 @@ static std::string ESFChanNames[] =
     "FM 1", "FM 2", "FM 3", "", "FM 4", "FM 5", "FM 6", "", "PSG 1", "PSG 2", "PSG 3", "PSG 4", "PCM"
 };
 
-static uint16_t PSGFreqs[12][7] = // [semitone][octave]
-{
-    // 0   1   2   3   4   5,  6
-    { 851,425,212,106, 53, 26, 13 }, // c
-    { 803,401,200,100, 50, 25, 12 }, // c#
-    { 758,379,189, 94, 47, 23, 11 }, // d
-    { 715,357,178, 89, 44, 22, 10 }, // d#
-    { 675,337,168, 84, 42, 21, 9 }, // e
-    { 637,318,159, 79, 39, 19, 8 }, // f
-    { 601,300,150, 75, 37, 18, 7 }, // f#
-    { 568,284,142, 71, 31, 15, 6 }, // g
-    { 536,268,134, 67, 33, 16, 5 }, // g#
-    { 506,253,126, 63, 31, 15, 4 }, // a
-    { 477,438,119, 59, 29, 14, 3 }, // a#
-    { 450,225,112, 56, 28, 14, 2 }, // b
-};
-
 static const int MaxFMFreqs = 12;
 static const int MaxOctave = 7;
-static uint16_t FMFreqs[MaxFMFreqs] =
+
+/** FM F-numbers and PSG dividers for every semitone and fine tune step, worked out at compile
+    time from the chip clocks. The FM octave is the block, so F-numbers don't depend on it. */
+struct FrequencyTable
 {
-    644,681,722,765,810,858,910,964,1021,1081,1146,1214
+	static const int sFineSteps = 16;           // per semitone
+	static const int sNumSteps = MaxFMFreqs * sFineSteps;
+	static const int sNumPSGOctaves = 8;        // octave 0 starts at C3
+
+	static constexpr double sNoteC3 = 130.8127826502993;
+
+	constexpr FrequencyTable(double fmClock, double psgClock) : m_fm(), m_psg()
+	{
+		for(int step = 0; step < sNumSteps; step++)
+		{
+			double ratio = Exp2(step / (12.0 * sFineSteps));
+
+			//F-number = Hz * 2^20 / (clock / 144) / 2^(block - 1), C4 sits in block 4
+			m_fm[step] = Round(sNoteC3 * 2 * ratio * 144.0 * (1 << 17) / fmClock);
+
+			for(int octave = 0; octave < sNumPSGOctaves; octave++)
+			{
+				//Divider = clock / (32 * Hz), 10 bits
+				uint16_t divider = Round(psgClock / (32.0 * sNoteC3 * (1 << octave) * ratio));
+				m_psg[octave][step] = divider > 0x3ff ? 0x3ff : divider;
+			}
+		}
+	}
+
+	uint16_t GetFM(int semitone, int fine = 0) const { return m_fm[GetStep(semitone, fine)]; }
+	uint16_t GetPSG(int semitone, int octave, int fine = 0) const
+	{
+		octave = octave < 0 ? 0 : (octave >= sNumPSGOctaves ? sNumPSGOctaves - 1 : octave);
+		return m_psg[octave][GetStep(semitone, fine)];
+	}
+
+	uint16_t m_fm[sNumSteps];
+	uint16_t m_psg[sNumPSGOctaves][sNumSteps];
+
+private:
+	//Out of range notes use the nearest entry
+	static int GetStep(int semitone, int fine)
+	{
+		int step = semitone * sFineSteps + fine;
+		return step < 0 ? 0 : (step >= sNumSteps ? sNumSteps - 1 : step);
+	}
+
+	//2^x for 0 <= x < 1, pow() isn't constexpr
+	static constexpr double Exp2(double x)
+	{
+		double term = 1.0;
+		double sum = 1.0;
+		for(int i = 1; i < 24; i++)
+		{
+			term *= x * 0.6931471805599453 / i;
+			sum += term;
+		}
+		return sum;
+	}
+
+	static constexpr uint16_t Round(double x) { return (uint16_t)(x + 0.5); }
 };
 
+extern const FrequencyTable NTSCFrequencies;
+extern const FrequencyTable PALFrequencies;
+
 static const int FM_TimerB_NTSC = 0xC9;
 static const int FM_TimerB_PAL = 0xBD;
 
@@ -252,9 +309,9 @@ struct EffectArpeggio
 
 	//0xx (arpeggio)
 	EffectMode  Arp;
-	uint16_t    Arp1;
+	uint16_t    Arp1;           // semitones above the note
 	uint16_t    Arp2;
-	uint8_t     ArpCounter;
+	uint8_t     ArpCounter;     // ticks since the note on
 };
 
 struct EffectPortmento
@@ -263,11 +320,7 @@ struct EffectPortmento
 
 	//1xx, 2xx (portamento)
 	EffectMode  Porta;
-	EffectStage Stage;
-	uint8_t     PortaSpeed;
-	uint8_t     Octave;
-	uint32_t    Semitone;
-	bool        NoteOnthisTick;
+	uint8_t     PortaSpeed;     // frequency register units per tick
 };
 
 struct EffectPortaNote
@@ -294,10 +347,11 @@ struct EffectVibrato
 	uint8_t     VibratoFineDepth;
 	uint8_t     VibratoDepth;
 	uint8_t     VibratoSpeed;
-	uint8_t     VibratoOffset;
+	uint8_t     VibratoOffset;  // LFO position
+	uint8_t     VibratoMode;    // E3xx, 0 up and down, 1 up only, 2 down only
 };
 
-// 5xx, 6xx ignored
+// 5xx, 6xx only slide the volume
 
 struct EffectTremolo
 {
@@ -308,7 +362,7 @@ struct EffectTremolo
 	uint8_t     TremoloActive;
 	uint8_t     TremoloDepth;
 	uint8_t     TremoloSpeed;
-	uint8_t     TremoloOffset;
+	uint8_t     TremoloOffset;  // LFO position
 };
 
 // 8xx (panning) doesn't need variables
@@ -320,7 +374,7 @@ struct EffectVolSlide
 	// Axx (volume slide)
 	EffectMode  VolSlide;
 	int8_t      VolSlideValue;
-	uint16_t    CurrVol;
+	int32_t     CurrVol;        // 16.16
 };
 
 // Bxx (position jump, global effect)
@@ -344,6 +398,7 @@ struct EffectNoteSlide
 	EffectMode  NoteSlide;
 	uint8_t     NoteSlideSpeed;
 	uint8_t     NoteSlideFinal;
+	int32_t     NoteSlideTarget; // 16.16 pitch
 };
 
 // E3xx (set vibrato mode)
@@ -403,6 +458,11 @@ struct Channel
 	uint8_t     LastVolume;
     uint8_t     SubtickFX;       // 0=none, >0=yes
 
+	int32_t     Pitch;           // 16.16 semitones above C-0, moved by slides
+	uint16_t    EffectFreq;      // frequency playing, 0 if effects can't bend it
+	uint8_t     EffectVolume;    // volume playing
+	bool        NoteOnThisRow;
+
 	EffectArpeggio m_effectArpeggio;
 	EffectPortmento m_effectPortmento;
 	EffectPortaNote m_effectPortaNote;
@@ -415,6 +475,13 @@ struct Channel
 	EffectNoteDelay m_effectNoteDelay;
 };
 
+/** What a channel's active effects add to its pitch and volume on one tick */
+struct TickOutput
+{
+	int32_t m_pitch;            // 16.16 semitones
+	int32_t m_volume;           // 16.16 volume steps
+};
+
 static const int ChannelCount[] =
 {
 	0,	//NONE
@@ -437,71 +504,205 @@ public:
 		STREAM_IN
 	};
 
-	Stream(char* ptr)
+	Stream(char* ptr, size_t size)
 	{
 		//TODO: Output support
 		m_direction = STREAM_IN;
 		m_ptr = ptr;
+		m_end = ptr + size;
+		m_failed = false;
 	}
 
 	Direction GetDirection() const { return m_direction; }
 
+	// True once a read ran past the end of the data or Fail() was called. Every
+	// read after that yields zeroes and empty views.
+	bool Failed() const { return m_failed; }
+	void Fail() { m_failed = true; }
+
 	template <typename T> void Serialise(T& value)
 	{
 		value.Serialise(*this);
 	}
 
-	void Serialise(int8_t& value)
+	void Serialise(int8_t& value)    { ReadValue(value); }
+	void Serialise(uint8_t& value)   { ReadValue(value); }
+	void Serialise(uint16_t& value)  { ReadValue(value); }
+	void Serialise(uint32_t& value)  { ReadValue(value); }
+	void Serialise(int32_t& value)   { ReadValue(value); }
+
+	void Serialise(std::string& value)
 	{
-		value = *(int8_t*)m_ptr;
-		m_ptr += sizeof(int8_t);
+		uint8_t length;
+		Serialise(length);
+		Serialise(value, length);
 	}
 
-	void Serialise(uint8_t& value)
+	void Serialise(std::string& value, uint8_t length)
 	{
-		value = *(uint8_t*)m_ptr;
-		m_ptr += sizeof(uint8_t);
+		value.clear();
+		if(Fits(length))
+		{
+			value.assign(m_ptr, length);
+			m_ptr += length;
+		}
 	}
 
-	void Serialise(uint16_t& value)
+	void Skip(uint32_t size)
 	{
-		value = *(uint16_t*)m_ptr;
-		m_ptr += sizeof(uint16_t);
+		if(Fits(size))
+			m_ptr += size;
 	}
 
-	void Serialise(uint32_t& value)
+	// Returns a pointer to the next 'size' bytes and skips them, for data
+	// that is read in place rather than copied out. NULL if they aren't there.
+	const uint8_t* View(uint64_t size)
 	{
-		value = *(uint32_t*)m_ptr;
-		m_ptr += sizeof(uint32_t);
+		if(!Fits(size))
+			return NULL;
+
+		const uint8_t* ptr = (const uint8_t*)m_ptr;
+		m_ptr += size;
+		return ptr;
 	}
 
-	void Serialise(int32_t& value)
+	static uint16_t ReadU16(const uint8_t* ptr)
 	{
-		value = *(int32_t*)m_ptr;
-		m_ptr += sizeof(int32_t);
+		uint16_t value;
+		memcpy(&value, ptr, sizeof(uint16_t));
+		return value;
 	}
 
-	void Serialise(std::string& value)
+	static uint32_t ReadU32(const uint8_t* ptr)
 	{
-		uint8_t length;
-		Serialise(length);
-		value.resize(length);
-		memcpy(&value[0], m_ptr, length);
-		m_ptr += length;
+		uint32_t value;
+		memcpy(&value, ptr, sizeof(uint32_t));
+		return value;
 	}
 
-	void Serialise(std::string& value, uint8_t length)
+private:
+	bool Fits(uint64_t size)
 	{
-		value.resize(length);
-		memcpy(&value[0], m_ptr, length);
-		m_ptr += length;
+		if(!m_failed && size > (uint64_t)(m_end - m_ptr))
+			m_failed = true;
+		return !m_failed;
+	}
+
+	template <typename T> void ReadValue(T& value)
+	{
+		value = 0;
+		if(Fits(sizeof(T)))
+		{
+			memcpy(&value, m_ptr, sizeof(T));
+			m_ptr += sizeof(T);
+		}
 	}
 
-private:
 	char* m_ptr;
+	const char* m_end;
+	bool m_failed;
 	Direction m_direction;
 };
 
+/** Bump allocator for per-module data. Only for types without destructors,
+    everything is released in one go when the arena is released or destroyed. */
+class Arena
+{
+	struct Block;
+
+public:
+	struct Mark
+	{
+		Block* block;
+		size_t used;
+	};
+
+	Arena(size_t blockSize = 64 * 1024)
+	{
+		m_blockSize = blockSize;
+		m_head = NULL;
+	}
+
+	~Arena()
+	{
+		Release();
+	}
+
+	template <typename T> T* Alloc(size_t count)
+	{
+		return (T*)Allocate(count * sizeof(T), alignof(T));
+	}
+
+	void* Allocate(size_t size, size_t align)
+	{
+		if(m_head)
+		{
+			size_t offset = (m_head->used + align - 1) & ~(align - 1);
+			if(offset + size <= m_head->size)
+			{
+				m_head->used = offset + size;
+				return m_head->Data() + offset;
+			}
+		}
+
+		//Start a new block, big allocations get a block of their own
+		size_t blockSize = std::max(m_blockSize, size + align);
+		Block* block = (Block*)malloc(sizeof(Block) + blockSize);
+		if(!block)
+			return NULL;
+
+		block->next = m_head;
+		block->size = blockSize;
+		m_head = block;
+
+		size_t offset = ((size_t)block->Data() + align - 1) & ~(align - 1);
+		block->used = offset - (size_t)block->Data() + size;
+		return (uint8_t*)offset;
+	}
+
+	// Allocations made after GetMark() are freed by Rewind()
+	Mark GetMark() const
+	{
+		Mark mark = { m_head, m_head ? m_head->used : 0 };
+		return mark;
+	}
+
+	void Rewind(const Mark& mark)
+	{
+		while(m_head != mark.block)
+		{
+			Block* next = m_head->next;
+			free(m_head);
+			m_head = next;
+		}
+
+		if(m_head)
+			m_head->used = mark.used;
+	}
+
+	void Release()
+	{
+		Mark empty = { NULL, 0 };
+		Rewind(empty);
+	}
+
+private:
+	struct Block
+	{
+		Block* next;
+		size_t size;
+		size_t used;
+
+		uint8_t* Data() { return (uint8_t*)(this + 1); }
+	};
+
+	size_t m_blockSize;
+	Block* m_head;
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+};
+
 struct DMFFile
 {
 	enum System
@@ -546,6 +747,7 @@ struct DMFFile
 	static const int sWaveTableDataSize = 4;
 	static const int sMaxEffects = 4;
 	static const int sMaxSamples = 16;
+	static const int sMaxRowsPerPattern = 255; // the row interpreter counts rows in bytes
 	static const int sTargetSampleRate = 10650;
 	static const int sSampleRates[6];
 
@@ -594,8 +796,10 @@ struct DMFFile
 			{
 				void Serialise(Stream& stream);
 
+				int32_t GetValue(int idx) const { return (int32_t)Stream::ReadU32(envelopeData + idx * sizeof(int32_t)); }
+
 				uint8_t envelopeSize;
-				int32_t* envelopeData;
+				const uint8_t* envelopeData; // envelopeSize int32s, in the module buffer
 				uint8_t loopPosition;
 			};
 
@@ -614,34 +818,21 @@ struct DMFFile
 	{
 		void Serialise(Stream& stream);
 
+		uint32_t GetValue(int idx) const { return Stream::ReadU32(m_waveTableData + idx * sizeof(uint32_t)); }
+
 		uint32_t m_waveTableSize;
-		uint32_t* m_waveTableData;
+		const uint8_t* m_waveTableData; // m_waveTableSize uint32s, in the module buffer
 	};
 
 	struct Channel
 	{
-		struct PatternPage
-		{
-			struct Note
-			{
-				struct Effect
-				{
-					uint16_t m_effectType;
-					uint16_t m_effectValue;
-				};
-
-				uint16_t m_note;
-				uint16_t m_octave;
-				uint16_t m_volume;
-				Effect m_effects[sMaxEffects];
-				uint16_t m_instrument;
-			};
-
-			Note* m_notes;
-		};
+		// Rows are stored as note, octave, volume, m_numEffects * (type, value), instrument
+		const uint8_t* GetRow(uint32_t page, uint32_t row) const { return m_patternData + (page * m_numRows + row) * m_rowSize; }
 
 		uint8_t m_numEffects;
-		PatternPage* m_patternPages;
+		uint32_t m_numRows;
+		uint32_t m_rowSize;
+		const uint8_t* m_patternData; // all pattern pages, in the module buffer
 	};
 
 	struct Sample
@@ -654,9 +845,14 @@ struct DMFFile
 		uint8_t m_pitch;
 		uint8_t m_amplitude;
 		uint8_t m_bitsPerSample;
-		uint16_t* m_sampleData;
+
+		uint16_t GetValue(uint32_t idx) const { return Stream::ReadU16(m_sampleData + idx * sizeof(uint16_t)); }
+
+		const uint8_t* m_sampleData; // m_sampleSize uint16s, in the module buffer
 	};
 
+	// Pattern, envelope, wave table and sample data are not copied, they point
+	// into the buffer the stream reads from, which must outlive the DMFFile
 	void Serialise(Stream& stream);
 
 	std::string m_formatString;
@@ -677,7 +873,7 @@ struct DMFFile
 	uint32_t m_numNoteRowsPerPattern;
 	uint8_t m_numPatternPages;
 	uint8_t m_arpeggioTickSpeed;
-	uint8_t* m_patternMatrix[sMaxChannels];
+	const uint8_t* m_patternMatrix[sMaxChannels];
 	uint8_t m_numInstruments;
 	Instrument m_instruments[sMaxInstruments];
 	uint8_t m_numWaveTables;
@@ -687,6 +883,66 @@ struct DMFFile
 	Sample m_samples[sMaxSamples];
 };
 
+/** Pattern data for the row interpreter. Build() only indexes the module: which physical pattern
+    each order position uses, and what the song contains. The cells of one order position are
+    unpacked into per-channel columns by LoadPage() when the interpreter gets there, so memory no
+    longer grows with the number of patterns. Cells are indexed by row. */
+struct PatternStore
+{
+	struct Effect
+	{
+		uint8_t m_type;
+		uint8_t m_value;
+	};
+
+	enum SlotFlags
+	{
+		SLOT_HAS_JUMP = 1 << 0,
+		SLOT_HAS_BREAK = 1 << 1,
+	};
+
+	static bool TestBit(const uint32_t* mask, uint32_t cell) { return (mask[cell >> 5] >> (cell & 31)) & 1; }
+	static void SetBit(uint32_t* mask, uint32_t cell) { mask[cell >> 5] |= 1u << (cell & 31); }
+
+	struct Column
+	{
+		bool HasEffects(uint32_t row) const { return TestBit(m_effectMask, row); }
+		bool IsOccupied(uint32_t row) const { return TestBit(m_occupiedMask, row); }
+		const Effect* GetEffects(uint32_t row) const { return &m_effects[row * m_numEffects]; }
+		uint8_t GetSlotFlags(uint32_t page) const { return m_slotFlags[m_pageSlots[page]]; }
+
+		const DMFFile::Channel* m_source;
+		int m_loadedSlot;           // slot the cells below hold, -1 before the first load
+
+		uint8_t* m_notes;
+		uint8_t* m_octaves;
+		uint8_t* m_volumes;
+		uint8_t* m_instruments;
+		Effect* m_effects;          // m_numEffects per cell
+		uint32_t* m_effectMask;     // bit set if the cell has at least one effect
+		uint32_t* m_occupiedMask;   // bit set if the cell has a note, volume, instrument or effect
+		uint8_t* m_pageSlots;       // order position -> pattern slot
+		uint8_t* m_slotFlags;       // SlotFlags by slot
+		uint32_t m_numSlots;
+		uint32_t m_numRows;
+		uint8_t m_numEffects;
+		bool m_hasNotes;            // at least one note on in the whole song
+		bool m_occupied;            // at least one occupied cell in the whole song
+	};
+
+	void Build(const DMFFile& dmfFile, int channelCount, Arena& arena);
+	void LoadColumn(int chan, uint32_t page);
+	void LoadPage(uint32_t page);
+
+	bool IsRowOccupied(uint32_t row) const { return TestBit(m_rowMask, row); }
+	bool HasSlotFlags(uint32_t page, uint8_t flags) const;
+
+	int m_numChannels;
+	uint32_t m_numRows;
+	uint32_t* m_rowMask;            // bit set if any channel's cell is occupied, by row of the loaded page
+	Column m_columns[DMFFile::sMaxChannels];
+};
+
 struct ESFFile
 {
 #pragma pack(push, 1)
@@ -713,22 +969,85 @@ struct ESFFile
 
 //=============================================================================
 
+/** One ESF command, recorded so the stream can be optimised before it is written */
+struct ESFEvent
+{
+	enum Type
+	{
+		NOTE_ON,
+		NOTE_OFF,
+		SET_VOLUME,
+		SET_FREQUENCY,
+		SET_INSTRUMENT,
+		LOCK_CHANNEL,
+		SET_PARAMS,
+		SET_REGISTER_BANK0,
+		SET_REGISTER_BANK1,
+		GOTO_LOOP,
+		SET_LOOP,
+		STOP_PLAYBACK,
+		DELAY,
+		PATTERN_ROW,            // ASM listing comment only
+	};
+
+	uint8_t m_type;
+	uint8_t m_channel;
+	uint16_t m_value;           // note, volume, frequency, instrument, params, register or pattern
+	uint32_t m_value2;          // octave, register value, row or delay ticks
+};
+
+void OptimizeEvents(std::vector<ESFEvent>& events);
+bool ReplayESF(const std::vector<uint8_t>& esf, std::vector<int32_t>& trace);
+uint32_t GetRepeatSavings(const std::vector<ESFEvent>& events);
+std::string GetCostReport(const std::vector<ESFEvent>& events, uint32_t tickBudget);
+
 class ESFOutput
 {
 private:
     void    SetShortDelay(uint8_t length); // use WaitCounter
     void    SetDelay(uint8_t length);
 
+    void    Put(uint8_t value) { Buffer.push_back(value); }
+
+    void    AddEvent(uint8_t type, uint8_t chan = 0, uint16_t value = 0, uint32_t value2 = 0);
+    void    Flush();
+
+    void    WriteNoteOn(ESFChannel chan, uint8_t note, uint8_t octave);
+    void    WriteNoteOff(ESFChannel chan);
+    void    WriteVolume(ESFChannel chan, uint8_t volume);
+    void    WriteFrequency(ESFChannel chan, uint16_t freq);
+    void    WriteInstrument(ESFChannel chan, uint8_t index);
+    void    WriteLockChannel(ESFChannel chan);
+    void    WriteParams(ESFChannel chan, uint8_t params);
+    void    WriteRegisterBank0(uint8_t reg, uint8_t value);
+    void    WriteRegisterBank1(uint8_t reg, uint8_t value);
+    void    WriteGotoLoop();
+    void    WriteSetLoop();
+    void    WriteStopPlayback();
+    void    WriteDelay(uint32_t ticks);
+    void    WritePatRow(uint8_t pattern, uint8_t row);
+
+    FILE*   OutFile;                // NULL when only kept in memory
+    std::vector<uint8_t> Buffer;    // binary commands, written out by Close()
+    std::vector<ESFEvent> Events;   // commands not yet written
+
 public:
-    std::ofstream ESFFile;
+    std::ostringstream ASMFile;     // listing text when writing ASM
 
 	bool VerboseLog;
+	bool Optimize;                  // run the peephole pass before writing
+	bool ReportRepeats;             // if set, Flush() estimates what subroutines would save
+	uint32_t RepeatSavings;         // see GetRepeatSavings()
+	uint32_t CostBudget;            // if set, Flush() reports the Z80 cost per tick against this many cycles
+	std::string CostReport;         // see GetCostReport()
 
 	uint8_t     InstrumentOffset;
 
     uint32_t    WaitCounter; // just increase every time you want to wait...
+    bool        OpenFailed;  // the output file couldn't be created, the caller must give up
 
     ESFOutput(std::string);             // ctor
+    ESFOutput();                        // in memory only
     virtual ~ESFOutput();    // dtor
 
     void    Wait();
@@ -748,9 +1067,142 @@ public:
 
     void    InsertPatRow(uint8_t pattern, uint8_t row);
 
+    const std::vector<uint8_t>& GetData();
     void    Close();
+
+    size_t  GetNumEvents() const { return Events.size(); }
+    void    GetEvents(size_t first, std::vector<ESFEvent>& events) const;
+    void    ReplayEvents(const std::vector<ESFEvent>& events, uint8_t pattern);
+};
+
+/** How DAC samples are brought to DMFFile::sTargetSampleRate */
+enum SampleQuality
+{
+	SAMPLE_QUALITY_NONE,            // copied as they are
+	SAMPLE_QUALITY_BEST,            // libsamplerate SRC_SINC_BEST_QUALITY
+	SAMPLE_QUALITY_MEDIUM,          // SRC_SINC_MEDIUM_QUALITY
+	SAMPLE_QUALITY_FAST,            // SRC_SINC_FASTEST
+	SAMPLE_QUALITY_FIR,             // short PolyphaseResampler filter
+	SAMPLE_QUALITY_LINEAR,          // SRC_LINEAR
+	SAMPLE_QUALITY_ZOH,             // SRC_ZERO_ORDER_HOLD
+
+	SAMPLE_QUALITY_COUNT
 };
 
+/** Resampler for one fixed rate pair, a filter per output phase. Either a short windowed sinc, or
+    libsamplerate's sinc filters precomputed from its tables. Much cheaper than the variable ratio
+    converters as nothing is computed per output but the filter itself. */
+class PolyphaseResampler
+{
+public:
+	PolyphaseResampler(int inputRate, int outputRate, int numTaps);
+	PolyphaseResampler(int inputRate, int outputRate, const float* table, int tableHalfLen, int tableIncrement);
+
+	uint32_t GetOutputSize(uint32_t numInput) const;
+	int64_t GetFirstInput(uint32_t outputIdx) const;
+	uint32_t GetInputSpan(uint32_t firstOutput, uint32_t numOutput) const;
+	uint32_t GetMaxInputSpan(uint32_t numOutput) const;
+	void Process(const float* input, uint32_t firstOutput, uint32_t numOutput, float* output) const;
+
+private:
+	void SetRates(int inputRate, int outputRate);
+
+	int m_numPhases;                // output rate / gcd
+	int m_step;                     // input rate / gcd
+	int m_numTaps;
+	int m_center;                   // tap at the input sample at or before the output
+	std::vector<float> m_coeffs;    // m_numTaps per phase
+};
+
+/** Float buffers for converting samples, reused for every sample a thread converts */
+struct SampleBuffers
+{
+	std::vector<float> m_input;
+	std::vector<float> m_output;
+};
+
+/** An instrument or sample produced by a conversion */
+struct OutputFile
+{
+	std::string m_name;
+	std::vector<uint8_t> m_data;
+};
+
+/** Lets the jobs of a batch take turns strictly in track order, whichever finishes first */
+class TrackTurn
+{
+public:
+	TrackTurn();
+
+	void Begin(int trackIdx);
+	void End(int trackIdx);
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_turn;
+	int m_nextTrack;
+};
+
+/** Batch-wide instrument and sample table. Identical payloads share one ESF index, and
+    tracks add theirs strictly in track order so indices are the same with or without -j. */
+class InstrumentPool
+{
+public:
+	InstrumentPool(int firstIndex);
+
+	void BeginTrack(int trackIdx);
+	void EndTrack(int trackIdx);
+	bool Add(const OutputFile& file, uint8_t& index, bool& isNew);
+
+	int GetNumUnique();
+	int GetNumAdded();
+
+private:
+	TrackTurn m_turn;
+	std::mutex m_mutex;
+	int m_nextIndex;
+	int m_numAdded;
+	std::unordered_map<std::string, uint8_t> m_entries;    // file type + payload -> ESF index
+};
+
+/** Hands each track of a -j batch its first instrument index in track order, as soon as the
+    track before it knows how many instruments and samples it has */
+class InstrumentOffsets
+{
+public:
+	InstrumentOffsets(int firstIndex);
+
+	int Claim(int trackIdx, int count);
+	void Skip(int trackIdx);
+
+private:
+	TrackTurn m_turn;
+	int m_nextIndex;    // only used during a turn
+};
+
+/** Converter state that a pattern's output depends on, restored on a memo hit. Memo keys are
+    built from the fields of it that matter, see DMFConverter::GetMemoKey(). */
+struct ParseState
+{
+	Channel m_channels[10];
+	uint32_t m_waitCounter;
+	uint8_t m_tickBase;
+	uint8_t m_tickTimeEvenRow;
+	uint8_t m_tickTimeOddRow;
+	bool m_DACEnabled;
+	bool m_PSGNoiseFreq;
+	bool m_PSGPeriodicNoise;
+};
+
+/** ESF events and exit state from converting one order position */
+struct PatternMemo
+{
+	ParseState m_exitState;
+	std::vector<ESFEvent> m_events;
+};
+
+class ConversionCache;
+
 class DMFConverter
 {
 public:
@@ -760,11 +1212,13 @@ public:
 	bool VerboseLog;
 
 	DMFFile m_dmfFile;
+	PatternStore m_patterns;
 
-    char*   comp_data;                  // compressed data
     std::vector<uint8_t>   data;                       // uncompressed data
 
-    uint32_t *   PatternData;           // pattern data table
+    Arena       m_arena;                // per-module allocations, freed with the converter
+
+    uint32_t *   PatternData;           // pattern data table (offset of each channel's pages in data)
 
 	bool LockChannels;
 	bool LoopWholeTrack;
@@ -772,11 +1226,23 @@ public:
 
 	std::set<uint8_t> UsedChannels;
 
+	std::vector<OutputFile>* OutputFiles;   // if set, instruments and samples are kept here instead of written
+
+	InstrumentPool* Pool;                   // if set, instruments and samples are shared across the batch
+	ConversionCache* SampleCache;           // if set, resampled samples are reused across modules and runs
+	InstrumentOffsets* Offsets;             // if set, InstrumentOffset is claimed once the counts are known
+	int         TrackIndex;                 // position in the batch, orders pool and offset access
+	bool        PoolTurnTaken;
+	bool        OffsetTurnTaken;
+	uint8_t     PoolMap[256];               // DMF instrument (samples after instruments) -> ESF index
+
     bool        UseTables;
     uint8_t     InstrumentTable[256];   // instrument conversion table
 	uint8_t     TotalInstruments;
 	uint8_t     TotalSamples;
     uint8_t     SampleTable[12];
+    SampleQuality ResampleQuality;      // SAMPLE_QUALITY_NONE copies samples as they are
+	int         SampleThreads;              // most threads OutputSamples() may use, 0 for one per core
 
 	uint8_t     InstrumentOffset;
 
@@ -790,6 +1256,8 @@ public:
     uint8_t     TickTimeEvenRow;
     uint8_t     TickTimeOddRow;
 
+    const FrequencyTable* Frequencies;  // NTSC or PAL, for frequencies written by effects
+
     uint8_t     CurrPattern;            // in pattern matrix.
     uint8_t     CurrRow;                // in pattern
 
@@ -800,7 +1268,6 @@ public:
 
     uint8_t     TotalRowsPerPattern;
     uint8_t     TotalPatterns;
-    uint32_t   * PatternList;
     uint8_t     ArpTickSpeed;           // arpeggio tick speed
 //    PSGNoiseMode    NoiseMode;        // Set here because this option affects
                                         // multiple channels.
@@ -820,27 +1287,154 @@ public:
     bool        LoopFlag;               // set to 1 when loop is found,
                                         // then 2 when we're ready to loop for real
 
+    bool        Memoize;                // reuse the output of order positions seen with the same state
+    std::unordered_map<std::string, PatternMemo> PatternMemos;  // keyed by GetMemoKey()
+    int         NumMemoHits;
+
     DMFConverter(ESFOutput ** esfout);             // ctor
     virtual     ~DMFConverter();    // dtor
     bool        Initialize(const char* Filename);     // load DMF
+    bool        Initialize(const uint8_t* dmfData, size_t dmfSize); // load DMF from memory
+    bool        InitializeModule();
     bool        Parse();    // parse DMF
+	bool        CanMemoize(uint32_t CurrPattern);
+	void        SaveState(ParseState& state);
+	void        RestoreState(const ParseState& state);
+	std::string GetMemoKey(uint32_t CurrPattern, uint32_t CurrRow);
+	bool        ParseRow(uint32_t CurrPattern, uint32_t CurrRow); // parse all channels in a row
 	bool        ParseChannelRow(uint8_t chan, uint32_t CurrPattern, uint32_t CurrRow); // parse channel
-	EffectStage GetActiveEffectStage(uint8_t chan);
-    int         ProcessActiveEffects(uint8_t chan);
+	void        RunEffects(uint8_t chan, const PatternStore::Effect* effects, uint8_t effectCount, EffectPhase phase, uint32_t CurrPattern);
+    int         ProcessActiveEffects(uint8_t chan, uint8_t tick);
+
+	/* Effect handlers, registered by effect type in sEffectTable */
+	void        OnDACEnable(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnPSGNoise(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnScheduleTonePortamento(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnScheduleNoteDelay(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnArpeggio(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnPortamento(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnPan(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnSetSpeed(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnVolumeSlide(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnVibrato(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnVibratoMode(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnFineVibratoDepth(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnTremolo(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnNoteSlide(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnRetrigger(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnNoteCut(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnJump(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+	void        OnBreak(uint8_t chan, const PatternStore::Effect& effect, uint32_t CurrPattern);
+
+	/* Active effects, run every tick in sTickEffects order. Return 1 while running */
+	int         ProcessRetrigger(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessNoteCut(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessPortamento(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessNoteSlide(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessArpeggio(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessVibrato(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessVolumeSlide(uint8_t chan, uint8_t tick, TickOutput& output);
+	int         ProcessTremolo(uint8_t chan, uint8_t tick, TickOutput& output);
+
+	void        StartNote(uint8_t chan);
     void        NoteOn(uint8_t chan); // checks channel type and sends appropriate command to ESF
-	void        SetFrequency(uint8_t chan, uint32_t FMSemitone, bool processDelay = true);
+	bool        CanBendPitch(uint8_t chan);
+	uint16_t    GetPitchFrequency(uint8_t chan, int32_t pitch);
+	uint8_t     GetMaxVolume(uint8_t chan);
 	void        OutputInstrument(int instrumentIdx, const char* filename); // outputs an FM instrument or PSG envelope
-	void        OutputSample(int sampleIdx, const char* filename, bool convertFormat);
+	bool        ConvertSample(int sampleIdx, SampleQuality quality, SampleBuffers& buffers, std::vector<uint8_t>& ewf) const;
+	void        OutputSamples(SampleQuality quality);   // writes the .ewf files, resampling in parallel
+	void        WriteOutputFile(const char* filename, const uint8_t* fileData, size_t size);
+	bool        AddToPool(std::vector<OutputFile>& files);
+	void        SkipTurns();
 
     uint16_t    GetFreq(ChannelType chan);
 
 };
 
+/* Module loading */
+bool LoadDMF(const char* Filename, std::vector<uint8_t>& data, bool VerboseLog = false);
+bool InflateDMF(const uint8_t* dmfData, size_t dmfSize, std::vector<uint8_t>& data);
+bool ScanDMF(const char* Filename, uint8_t& numInstruments, uint8_t& numSamples);
+
+/* In-memory conversion */
+enum ConvertResult
+{
+	CONVERT_OK = 0,
+	CONVERT_INVALID_MODULE,         // failed to decompress, or not a DefleMask module
+	CONVERT_UNSUPPORTED_SYSTEM,     // neither Genesis nor Master System
+	CONVERT_PARSE_FAILED,
+	CONVERT_IO_ERROR,               // could not read the module or write the outputs
+};
+
+struct ConvertOptions
+{
+	ConvertOptions() : m_loopWholeTrack(false), m_lockChannels(false), m_PALMode(false), m_instrumentOffset(0), m_optimize(true), m_sampleQuality(SAMPLE_QUALITY_NONE), m_costBudget(0), m_reportRepeats(false), m_useTables(false), m_sampleCache(NULL), m_sampleThreads(0), m_memoize(true)
+	{
+		memset(m_instrumentTable, 0, sizeof(m_instrumentTable));
+		memset(m_sampleTable, 0, sizeof(m_sampleTable));
+	}
+
+	bool m_loopWholeTrack;
+	bool m_lockChannels;
+	bool m_PALMode;
+	uint8_t m_instrumentOffset;
+	bool m_optimize;                    // peephole pass over the ESF stream
+	uint8_t m_sampleQuality;            // SampleQuality
+	uint32_t m_costBudget;              // see ESFOutput::CostBudget
+	bool m_reportRepeats;               // see ESFOutput::ReportRepeats
+
+	bool m_useTables;                   // INI instrument/sample conversion tables
+	uint8_t m_instrumentTable[256];
+	uint8_t m_sampleTable[12];
+
+	ConversionCache* m_sampleCache;     // if set, resampled samples are reused from here, not hashed
+	int m_sampleThreads;                // see DMFConverter::SampleThreads, not hashed
+	bool m_memoize;                     // see DMFConverter::Memoize, not hashed, the output is the same
+};
+
+struct ConvertOutput
+{
+	std::vector<uint8_t> m_esf;         // ESF stream (listing text if ASMOut is set)
+	std::vector<OutputFile> m_files;    // .eif instruments then .ewf samples, named as on disk
+	std::set<uint8_t> m_usedChannels;
+	uint8_t m_numInstruments;
+	uint8_t m_numSamples;
+	uint32_t m_repeatSavings;           // see ESFOutput::RepeatSavings
+	std::string m_costReport;           // see ESFOutput::CostReport
+};
+
+ConvertResult ConvertDMF(const uint8_t* dmfData, size_t dmfSize, const ConvertOptions& options, ConvertOutput& output);
+ConvertResult ConvertDMFFile(const char* Filename, const ConvertOptions& options, ConvertOutput& output);
+bool WriteConvertOutput(const char* outFilename, const ConvertOutput& output);
+bool CheckMemoization(const char* Filename, const ConvertOptions& options);
+
+/** On-disk cache of finished conversions, keyed on the compressed module and all options */
+class ConversionCache
+{
+public:
+	ConversionCache(const std::string& directory);
+
+	ConvertResult Convert(const char* inFilename, const char* outFilename, const ConvertOptions& options, ConvertOutput& output, bool VerboseLog = false);
+	ConvertResult GetOutput(const char* inFilename, const ConvertOptions& options, ConvertOutput& output, bool VerboseLog = false);
+
+	uint64_t GetKey(const uint8_t* dmfData, size_t dmfSize, const ConvertOptions& options) const;
+	bool Load(uint64_t key, ConvertOutput& output) const;
+	bool Store(uint64_t key, const ConvertOutput& output) const;
+
+	uint64_t GetSampleKey(const DMFFile::Sample& sample, uint8_t quality) const;
+	bool LoadSample(uint64_t key, std::vector<uint8_t>& ewf) const;
+	bool StoreSample(uint64_t key, const std::vector<uint8_t>& ewf) const;
+
+private:
+	std::string GetEntryPath(uint64_t key, const char* extension) const;
+
+	std::string m_directory;
+};
+
 /* Helper functions */
-double divrest(double a, int b);
-uint16_t fmfreq(double a);
-uint16_t fmfreq2(long a);
 void FindInstruments(char * inisection, INIReader *ini, DMFConverter *dmf);
+void FindInstruments(char * inisection, INIReader *ini, uint8_t *InstrumentTable, uint8_t *SampleTable);
 
 //=============================================================================
 
@@ -174,6 +174,15 @@ void src_float_to_short_array (const float *in, short *out, int len) ;
 void src_int_to_float_array (const int *in, float *out, int len) ;
 void src_float_to_int_array (const float *in, int *out, int len) ;
 
+/*
+** Gives read access to the half filter table of one of the sinc converters,
+** so that fixed ratio filters can be built from it. Coefficient n is the
+** filter at n / increment input samples from the centre, half_len is the
+** last index to interpolate from. Returns non-zero for other converters.
+*/
+
+int src_sinc_get_table (int converter_type, const float **coeffs, int *half_len, int *increment) ;
+
 
 #ifdef __cplusplus
 }		/* extern "C" */
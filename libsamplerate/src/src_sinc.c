@@ -135,6 +135,35 @@ sinc_get_description (int src_enum)
 	return NULL ;
 } /* sinc_get_descrition */
 
+int
+src_sinc_get_table (int converter_type, const float **coeffs, int *half_len, int *increment)
+{
+	switch (converter_type)
+	{	case SRC_SINC_FASTEST :
+				*coeffs = fastest_coeffs.coeffs ;
+				*half_len = ARRAY_LEN (fastest_coeffs.coeffs) - 2 ;
+				*increment = fastest_coeffs.increment ;
+				break ;
+
+		case SRC_SINC_MEDIUM_QUALITY :
+				*coeffs = slow_mid_qual_coeffs.coeffs ;
+				*half_len = ARRAY_LEN (slow_mid_qual_coeffs.coeffs) - 2 ;
+				*increment = slow_mid_qual_coeffs.increment ;
+				break ;
+
+		case SRC_SINC_BEST_QUALITY :
+				*coeffs = slow_high_qual_coeffs.coeffs ;
+				*half_len = ARRAY_LEN (slow_high_qual_coeffs.coeffs) - 2 ;
+				*increment = slow_high_qual_coeffs.increment ;
+				break ;
+
+		default :
+				return SRC_ERR_BAD_CONVERTER ;
+		} ;
+
+	return SRC_ERR_NO_ERROR ;
+} /* src_sinc_get_table */
+
 int
 sinc_set_converter (SRC_PRIVATE *psrc, int src_enum)
 {	SINC_FILTER *filter, temp_filter ;
@@ -1,11 +1,299 @@
 #include "dmf2esf.h"
 
+#include <thread>
+#include <atomic>
+
 using namespace std;
 
 bool OutputInstruments = false;
 bool ASMOut = false;
 bool ExCommands = false;
 
+static ConversionCache* Cache = NULL;   // set with -cache
+static InstrumentPool* Pool = NULL;     // set with -dedup
+static InstrumentOffsets* Offsets = NULL;   // set with -j without -dedup
+static bool Optimize = true;            // cleared with -noopt
+static uint32_t CostBudget = 0;         // set with -cost
+static SampleQuality Quality = SAMPLE_QUALITY_NONE; // set with -q
+static int SampleThreads = 0;           // cores left for each -j job to resample with, 0 for all
+static bool CheckMemo = false;          // set with -checkmemo
+
+/** -q names, in SampleQuality order */
+static const char* sQualityNames[SAMPLE_QUALITY_COUNT] = { "none", "best", "medium", "fast", "fir", "linear", "zoh" };
+
+struct File
+{
+	std::string InFilename;
+	std::string OutFilename;
+	bool loopWholeTrack = false;
+	bool lockChannels = false;
+	bool PALMode = false;
+	uint16_t ChannelMask = 0;
+	int InstrumentOffset = 0;
+	int InstrumentCount = 0;    // instruments + samples written
+	int Index = 0;              // position on the command line
+};
+
+/** @brief Reports what subroutines could save on repeated sequences, only worked out with -v */
+static void PrintRepeatSavings(uint32_t savings)
+{
+	if(!savings)
+		return;
+
+	fprintf(stdout, "Repeated sequences: %u bytes could be saved if Echo had subroutines\n", savings);
+}
+
+/** @brief Fills in the options ConvertDMF() needs to convert file as the command line asks */
+static void GetConvertOptions(const File& file, bool Verbose, ConvertOptions& options)
+{
+	options.m_loopWholeTrack = file.loopWholeTrack;
+	options.m_lockChannels = file.lockChannels;
+	options.m_PALMode = file.PALMode;
+	options.m_instrumentOffset = file.InstrumentOffset;
+	options.m_optimize = Optimize;
+	options.m_sampleQuality = Quality;
+	options.m_costBudget = CostBudget;
+	options.m_reportRepeats = Verbose;
+	options.m_sampleThreads = SampleThreads;
+}
+
+/** @brief Gives up a track's pool and offset turns when it fails before the converter takes them,
+    later tracks wait for them **/
+static void SkipTurns(const File& file)
+{
+	if(Pool)
+	{
+		Pool->BeginTrack(file.Index);
+		Pool->EndTrack(file.Index);
+	}
+
+	if(Offsets)
+	{
+		Offsets->Skip(file.Index);
+	}
+}
+
+/** @brief Converts a single input/output pair, returns true on failure */
+static bool ConvertFile(File& file, bool Verbose)
+{
+	if(Offsets)
+		fprintf(stdout, "Converting: %s\n", file.InFilename.c_str());
+	else
+		fprintf(stdout, "Converting: %s from instrument offset %i\n", file.InFilename.c_str(), file.InstrumentOffset);
+
+	if(CheckMemo)
+	{
+		ConvertOptions options;
+		GetConvertOptions(file, false, options);
+		if(CheckMemoization(file.InFilename.c_str(), options))
+		{
+			SkipTurns(file);
+			return true;
+		}
+	}
+
+	if(Cache && !Pool)
+	{
+		//The offset is part of the cache key, so it's needed before the module is converted
+		if(Offsets)
+		{
+			uint8_t numInstruments = 0;
+			uint8_t numSamples = 0;
+			if(ScanDMF(file.InFilename.c_str(), numInstruments, numSamples))
+			{
+				SkipTurns(file);
+				fprintf(stderr, "Aborting\n");
+				return true;
+			}
+
+			file.InstrumentOffset = Offsets->Claim(file.Index, numInstruments + numSamples);
+		}
+
+		ConvertOptions options;
+		GetConvertOptions(file, Verbose, options);
+
+		ConvertOutput output;
+		if(Cache->Convert(file.InFilename.c_str(), file.OutFilename.c_str(), options, output, Verbose) != CONVERT_OK)
+		{
+			fprintf(stderr, "Aborting\n");
+			return true;
+		}
+
+		fprintf(stdout, "Done. Instruments: %i Samples: %i\n", output.m_numInstruments, output.m_numSamples);
+		PrintRepeatSavings(output.m_repeatSavings);
+		fputs(output.m_costReport.c_str(), stdout);
+
+		file.InstrumentCount = output.m_numInstruments + output.m_numSamples;
+
+		for(std::set<uint8_t>::iterator it = output.m_usedChannels.begin(), end = output.m_usedChannels.end(); it != end; ++it)
+		{
+			file.ChannelMask |= 1 << *it;
+		}
+		return false;
+	}
+
+	ESFOutput* esf = new ESFOutput(file.OutFilename);
+	DMFConverter* dmf = new DMFConverter(&esf);
+
+	esf->InstrumentOffset = file.InstrumentOffset;
+	dmf->InstrumentOffset = file.InstrumentOffset;
+	esf->VerboseLog = Verbose;
+	esf->ReportRepeats = Verbose;
+	esf->Optimize = Optimize;
+	esf->CostBudget = CostBudget;
+	dmf->VerboseLog = Verbose;
+	dmf->ResampleQuality = Quality;
+	dmf->SampleThreads = SampleThreads;
+	dmf->PALMode = file.PALMode;
+	dmf->LoopWholeTrack = file.loopWholeTrack;
+	dmf->LockChannels = file.lockChannels;
+
+	if(Pool)
+	{
+		//The pool hands out the indices, starting from -instroffset
+		esf->InstrumentOffset = 0;
+		dmf->InstrumentOffset = 0;
+		dmf->Pool = Pool;
+		dmf->TrackIndex = file.Index;
+	}
+	else if(Offsets)
+	{
+		dmf->Offsets = Offsets;
+		dmf->TrackIndex = file.Index;
+	}
+
+	//Only reached with -dedup when caching, pooled conversions can't be stored whole
+	dmf->SampleCache = Cache;
+
+	bool failed = false;
+
+	if(esf->OpenFailed)
+	{
+		fprintf(stderr, "Aborting\n");
+		failed = true;
+	}
+	else if(dmf->Initialize(file.InFilename.c_str()))
+	{
+		fprintf(stderr, "Aborting\n");
+		failed = true;
+	}
+	else if(dmf->Parse())
+	{
+		fprintf(stderr, "Conversion aborted.\n");
+		failed = true;
+	}
+	else
+	{
+		esf->Close();
+
+		fprintf(stdout, "Done. Instruments: %i Samples: %i\n", dmf->TotalInstruments, dmf->TotalSamples);
+		PrintRepeatSavings(esf->RepeatSavings);
+		fputs(esf->CostReport.c_str(), stdout);
+
+		file.InstrumentCount = dmf->TotalInstruments + dmf->TotalSamples;
+
+		for(std::set<uint8_t>::iterator it = dmf->UsedChannels.begin(), end = dmf->UsedChannels.end(); it != end; ++it)
+		{
+			file.ChannelMask |= 1 << *it;
+		}
+	}
+
+	dmf->SkipTurns();
+
+	delete dmf;
+	delete esf;
+	return failed;
+}
+
+/** One [N] section of an INI file, converted in memory and written out in section order */
+struct ConfigSection
+{
+	std::string Input;
+	std::string Output;
+	ConvertOptions Options;
+	ConvertOutput Result;
+};
+
+/** @brief Converts a section in memory, returns true on failure. Safe to run on several sections at
+    once, nothing is written but cache entries. **/
+static bool ConvertIniSection(ConfigSection& section)
+{
+	fprintf(stderr, "Converting %s to %s\n", section.Input.c_str(), section.Output.c_str());
+
+	if(CheckMemo && CheckMemoization(section.Input.c_str(), section.Options))
+	{
+		fprintf(stderr, "Conversion of %s failed, aborting\n", section.Input.c_str());
+		return true;
+	}
+
+	ConvertResult result;
+	if(Cache)
+		result = Cache->GetOutput(section.Input.c_str(), section.Options, section.Result);
+	else
+		result = ConvertDMFFile(section.Input.c_str(), section.Options, section.Result);
+
+	if(result != CONVERT_OK)
+	{
+		fprintf(stderr, "Conversion of %s failed, aborting\n", section.Input.c_str());
+		return true;
+	}
+	return false;
+}
+
+/** @brief Writes a converted section, returns true on failure. Sections all start at instrument 0 and
+    write the same instr_XX files, so they are written in order and the last one to use an index wins. **/
+static bool WriteIniSection(const ConfigSection& section)
+{
+	if(WriteConvertOutput(section.Output.c_str(), section.Result))
+		return true;
+
+	fputs(section.Result.m_costReport.c_str(), stdout);
+	fprintf(stdout, "Successfully converted %s, continuing.\n", section.Input.c_str());
+	return false;
+}
+
+/** @brief Runs Job(0..NumJobs-1) on NumThreads workers, stops handing out jobs after the first failure.
+    A job that was handed out always runs, later tracks may be waiting on its pool turn. */
+template <typename T> static bool RunJobs(int NumJobs, int NumThreads, T Job)
+{
+	if(NumThreads <= 1)
+	{
+		for(int i = 0; i < NumJobs; i++)
+		{
+			if(Job(i))
+				return true;
+		}
+		return false;
+	}
+
+	std::atomic<int> NextJob(0);
+	std::atomic<bool> Failed(false);
+	std::vector<std::thread> Workers;
+
+	for(int i = 0; i < NumThreads && i < NumJobs; i++)
+	{
+		Workers.push_back(std::thread([&]()
+		{
+			while(!Failed)
+			{
+				int j = NextJob++;
+				if(j >= NumJobs)
+					break;
+
+				if(Job(j))
+					Failed = true;
+			}
+		}));
+	}
+
+	for(int i = 0; i < Workers.size(); i++)
+	{
+		Workers[i].join();
+	}
+
+	return Failed;
+}
+
 int main(int argc, char *argv[])
 {
     int     InputId = 0;
@@ -17,8 +305,6 @@ int main(int argc, char *argv[])
 	bool Verbose = false;
 	bool OutputChannelMask = false;
 
-    DMFConverter * dmf;
-    ESFOutput * esf;
     INIReader * ini;
 
     fprintf(stdout, "\nDMF2ESF ver %d.%d (built %s %s)\n", MAJORVER, MINORVER, __DATE__, __TIME__);
@@ -29,20 +315,13 @@ int main(int argc, char *argv[])
 
 	bool error = false;
 
-	struct File
-	{
-		std::string InFilename;
-		std::string OutFilename;
-		bool loopWholeTrack = false;
-		bool lockChannels = false;
-		bool PALMode = false;
-		uint16_t ChannelMask = 0;
-	};
-
 	std::vector<File> filenames;
 
 	const char* configFile = NULL;
 	int instrumentIdxOffset = 0;
+	int numThreads = 1;
+	const char* cacheDir = NULL;
+	bool dedup = false;
 
 	File currentFile;
 
@@ -95,6 +374,72 @@ int main(int argc, char *argv[])
 					error = true;
 				}
 			}
+			else if(!strcmp(argv[i], "-j"))
+			{
+				i++;
+				if(i < argc)
+				{
+					numThreads = atoi(argv[i]);
+					if(numThreads <= 0)
+						numThreads = std::thread::hardware_concurrency();
+				}
+				else
+				{
+					error = true;
+				}
+			}
+			else if(!strcmp(argv[i], "-dedup"))
+			{
+				dedup = true;
+			}
+			else if(!strcmp(argv[i], "-checkmemo"))
+			{
+				CheckMemo = true;
+			}
+			else if(!strcmp(argv[i], "-noopt"))
+			{
+				Optimize = false;
+			}
+			else if(!strcmp(argv[i], "-q"))
+			{
+				i++;
+				int quality = 0;
+				while(quality < SAMPLE_QUALITY_COUNT && (i >= argc || strcmp(argv[i], sQualityNames[quality])))
+					quality++;
+
+				if(quality < SAMPLE_QUALITY_COUNT)
+				{
+					Quality = (SampleQuality)quality;
+				}
+				else
+				{
+					error = true;
+				}
+			}
+			else if(!strcmp(argv[i], "-cost"))
+			{
+				i++;
+				if(i < argc && atoi(argv[i]) > 0)
+				{
+					CostBudget = atoi(argv[i]);
+				}
+				else
+				{
+					error = true;
+				}
+			}
+			else if(!strcmp(argv[i], "-cache"))
+			{
+				i++;
+				if(i < argc)
+				{
+					cacheDir = argv[i];
+				}
+				else
+				{
+					error = true;
+				}
+			}
 			else if(!strcmp(argv[i], "-instroffset"))
 			{
 				i++;
@@ -117,6 +462,7 @@ int main(int argc, char *argv[])
 					std::string outFile = argv[i];
 					currentFile.InFilename = inFile;
 					currentFile.OutFilename = outFile;
+					currentFile.Index = filenames.size();
 
 					filenames.push_back(currentFile);
 					currentFile = File();
@@ -144,15 +490,38 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "\t-m : Output used channel mask\n");
 		fprintf(stderr, "\t-v : Verbose output\n");
 		fprintf(stderr, "\t-instroffset : Offset the first instrument index\n");
+		fprintf(stderr, "\t-j <jobs> : Convert up to <jobs> files at once (0 = one per core)\n");
+		fprintf(stderr, "\t-cache <dir> : Reuse earlier conversions stored in <dir>\n");
+		fprintf(stderr, "\t-dedup : Share identical instruments and samples between tracks\n");
+		fprintf(stderr, "\t-noopt : Write the ESF stream without removing redundant commands\n");
+		fprintf(stderr, "\t-q <quality> : Resample DAC samples to 10650 Hz, none/best/medium/fast/fir/linear/zoh (default none)\n");
+		fprintf(stderr, "\t-cost <cycles> : Report the estimated Z80 cost per tick, flag ticks over <cycles>\n");
+		fprintf(stderr, "\t-checkmemo : Also convert without pattern reuse and the peephole pass, fail if the output differs\n");
         fprintf(stderr, "Please read \"readme.md\" for further usage instructions.\n");
-
-        //for(int a=0;a<12*7;a++)
-        //{
-        //    fprintf(stderr, "%d\n", fmfreq(a));
-        //}
     }
     else
     {
+        if(dedup && configFile)
+        {
+            fprintf(stderr, "-dedup is ignored with an INI file, the instrument tables decide the indices\n");
+            dedup = false;
+        }
+
+        if(dedup && cacheDir)
+        {
+            fprintf(stderr, "-cache only keeps resampled samples with -dedup\n");
+        }
+
+        if(cacheDir)
+        {
+            Cache = new ConversionCache(cacheDir);
+        }
+
+        if(dedup)
+        {
+            Pool = new InstrumentPool(instrumentIdxOffset);
+        }
+
         if(configFile)
         {
             fprintf(stdout, "Loading ini: %s\n",configFile);
@@ -163,12 +532,11 @@ int main(int argc, char *argv[])
                 return EXIT_FAILURE;
             }
 
-            bool SearchFlag=true;
             int TrackIndex=0;
             char IniSection[64];
-            string input;
+            std::vector<ConfigSection> sections;
 
-            while(SearchFlag)
+            while(true)
             {
                 sprintf(IniSection,"%d",TrackIndex);
                 fprintf(stdout, "======== Reading [%s] ========\n",IniSection);
@@ -182,7 +550,6 @@ int main(int argc, char *argv[])
                     }
 
                     string output = ini->Get(IniSection,"output","");
-                    bool TrackSFX = ini->GetBoolean(IniSection,"sfx",false);
                     if(output.length() == 0)
                         output = input.substr(0,input.rfind("."));
 
@@ -192,26 +559,16 @@ int main(int argc, char *argv[])
                         return EXIT_FAILURE;
                     }
 
-                    fprintf(stderr, "Converting %s to %s\n",input.c_str(), output.c_str());
-
-                    esf = new ESFOutput(output);
-                    dmf = new DMFConverter(&esf);
-
-                    FindInstruments(IniSection,ini,dmf);
-
-                    if(dmf->Initialize(input.c_str()))
-                    {
-                        fprintf(stderr, "Failed to initialize, aborting\n");
-                        break;
-                    }
-                    if(dmf->Parse())
-                    {
-                        fprintf(stderr, "Conversion failed, aborting\n");
-                        break;
-                    }
-                    fprintf(stdout, "Successfully converted, continuing.\n");
-                    delete esf;
-                    delete dmf;
+                    //Tables are read here so the assignments print in section order
+                    sections.push_back(ConfigSection());
+                    ConfigSection& section = sections.back();
+                    section.Input = input;
+                    section.Output = output;
+                    section.Options.m_useTables = true;
+                    section.Options.m_optimize = Optimize;
+                    section.Options.m_sampleQuality = Quality;
+                    section.Options.m_costBudget = CostBudget;
+                    FindInstruments(IniSection, ini, section.Options.m_instrumentTable, section.Options.m_sampleTable);
                 }
                 else
                 {
@@ -220,49 +577,73 @@ int main(int argc, char *argv[])
                 }
                 TrackIndex++;
             }
+
             delete ini;
+
+            if(numThreads > 1 && sections.size() > 0)
+            {
+                int numJobs = std::min<int>(numThreads, sections.size());
+                SampleThreads = std::max<int>(1, std::thread::hardware_concurrency() / numJobs);
+                for(size_t i = 0; i < sections.size(); i++)
+                    sections[i].Options.m_sampleThreads = SampleThreads;
+            }
+
+            //Convert in memory on the workers, each section is written as soon as the ones before it
+            //are, and nothing after a failed section is written
+            TrackTurn writeTurn;
+            bool writeFailed = false;   // only used during a write turn
+            if(RunJobs(sections.size(), numThreads, [&](int i)
+            {
+                ConfigSection& section = sections[i];
+                bool failed = ConvertIniSection(section);
+
+                writeTurn.Begin(i);
+                if(!failed && !writeFailed)
+                    failed = WriteIniSection(section);
+                writeFailed |= failed;
+                writeTurn.End(i);
+
+                section.Result = ConvertOutput();
+                return failed;
+            }))
+                return EXIT_FAILURE;
         }
         else
         {
-			for(int i = 0; i < filenames.size(); i++)
+			if(numThreads > 1)
 			{
-				File& file = filenames[i];
-
-				fprintf(stdout, "Converting: %s from instrument offset %i\n", file.InFilename.c_str(), instrumentIdxOffset);
-
-				esf = new ESFOutput(file.OutFilename);
-				dmf = new DMFConverter(&esf);
+				//Every job resamples with its share of the cores, the batch stays near one thread per core
+				int numJobs = std::min<int>(numThreads, filenames.size());
+				SampleThreads = std::max<int>(1, std::thread::hardware_concurrency() / numJobs);
+			}
 
-				esf->InstrumentOffset = instrumentIdxOffset;
-				dmf->InstrumentOffset = instrumentIdxOffset;
-				esf->VerboseLog = Verbose;
-				dmf->VerboseLog = Verbose;
-				dmf->PALMode = file.PALMode;
-				dmf->LoopWholeTrack = file.loopWholeTrack;
-				dmf->LockChannels = file.lockChannels;
+			if(numThreads > 1)
+			{
+				//Instrument offsets normally carry over from the previous track, each job claims its
+				//own once the module is loaded. The pool orders the tracks itself.
+				if(!Pool)
+					Offsets = new InstrumentOffsets(instrumentIdxOffset);
 
-				if(dmf->Initialize(file.InFilename.c_str()))
-				{
-					fprintf(stderr, "Aborting\n");
+				if(RunJobs(filenames.size(), numThreads, [&](int i) { return ConvertFile(filenames[i], Verbose); }))
 					return EXIT_FAILURE;
-				}
-				if(dmf->Parse())
+			}
+			else
+			{
+				for(int i = 0; i < filenames.size(); i++)
 				{
-					fprintf(stderr, "Conversion aborted.\n");
-					return EXIT_FAILURE;
-				}
-
-				fprintf(stdout, "Done. Instruments: %i Samples: %i\n", dmf->TotalInstruments, dmf->TotalSamples);
+					File& file = filenames[i];
+					file.InstrumentOffset = instrumentIdxOffset;
 
-				instrumentIdxOffset += dmf->TotalInstruments + dmf->TotalSamples;
+					if(ConvertFile(file, Verbose))
+						return EXIT_FAILURE;
 
-				for(std::set<uint8_t>::iterator it = dmf->UsedChannels.begin(), end = dmf->UsedChannels.end(); it != end; ++it)
-				{
-					file.ChannelMask |= 1 << *it;
+					instrumentIdxOffset += file.InstrumentCount;
 				}
+			}
 
-				delete dmf;
-				delete esf;
+			if(Pool)
+			{
+				fprintf(stdout, "Instrument pool: %i files for %i instruments and samples\n", Pool->GetNumUnique(), Pool->GetNumAdded());
 			}
 
 			if(OutputChannelMask)